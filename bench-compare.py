@@ -0,0 +1,47 @@
+#!/usr/bin/python
+#
+# compare 'bench -json' results: time per op for each workload in each
+# file, and the speedup of each over the first, e.g.
+#   python bench-compare.py build/debug/bench.json build/release/bench.json
+#
+import sys
+import json
+import math
+import os
+
+if len(sys.argv) < 2:
+    print ('usage: %s base.json other.json ...' % sys.argv[0])
+    sys.exit(1)
+
+runs = []
+names = None
+for f in sys.argv[1:]:
+    with open(f) as fp:
+        d = json.load(fp)
+    # build/release/bench.json -> release
+    label = os.path.basename(os.path.dirname(f)) or f
+    runs.append((label, dict((r['name'], r) for r in d['results'])))
+    if names is None:
+        names = [r['name'] for r in d['results']]
+
+print ('%-18s' % 'us/op' + ''.join('%14s' % label for label, _ in runs))
+logs = [[] for _ in runs]
+for name in names:
+    line = '%-18s' % name
+    base = runs[0][1][name]['usec_per_op']
+    for i, (label, res) in enumerate(runs):
+        if name not in res:
+            line += '%14s' % '-'
+            continue
+        t = res[name]['usec_per_op']
+        if i == 0 or t <= 0 or base <= 0:
+            line += '%14.2f' % t
+        else:
+            line += '%8.2f %4.2fx' % (t, base / t)
+            logs[i].append(math.log(base / t))
+    print (line)
+
+line = '%-18s%14s' % ('geomean speedup', '1.00x')
+for l in logs[1:]:
+    line += '%13.2fx' % (math.exp(sum(l) / len(l)) if l else 0)
+print (line)
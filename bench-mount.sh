@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# file:        bench-mount.sh
+# description: time metadata-heavy commands (find, ls -lR, stat of
+#              names that don't exist) through a real FUSE mount, once
+#              for each kernel caching setting. bench.c calls fs_ops
+#              directly, so it can't see what the kernel caches.
+#
+#  usage: ./bench-mount.sh [directory]     (default mnt)
+#         needs /dev/fuse and fusermount; builds hw3fuse and hw3ll first
+#
+# Each command runs twice per mount: the first pass fills the kernel's
+# dentry and attribute caches, the second shows what they save.
+#
+set -e
+MNT=${1:-mnt}
+IMG=bench-mount.img
+mkdir -p $MNT
+
+usec() {
+    local t0=$(date +%s%N)
+    "$@" > /dev/null 2>&1 || true
+    echo $(( ($(date +%s%N) - t0) / 1000 ))
+}
+
+stat_missing() {
+    for i in $(seq 1 200); do
+        stat $MNT/d0/nothere.$((i % 20)) 2> /dev/null || true
+    done
+}
+
+# a tree of 16 directories x 64 files on the bench image
+python gen-disk.py -q bench.in $IMG
+./hw3fuse -image $IMG $MNT
+for d in $(seq 0 15); do
+    mkdir $MNT/d$d
+    for f in $(seq 0 63); do
+        echo $f > $MNT/d$d/f$f
+    done
+done
+fusermount -u $MNT
+
+printf "%-36s %10s %10s %10s %10s %10s %10s\n" setting find find-2 \
+       ls-lR ls-lR-2 stat-miss stat-miss-2
+while read prog opts; do
+    ./$prog -image $IMG $opts $MNT
+    r=""
+    for cmd in "find $MNT" "ls -lR $MNT" stat_missing; do
+        r="$r $(usec $cmd) $(usec $cmd)"
+    done
+    fusermount -u $MNT
+    printf "%-36s %10s %10s %10s %10s %10s %10s (usec)\n" "$prog $opts" $r
+done <<EOF
+hw3fuse -timeout 0 -negative 0
+hw3fuse -timeout 1 -negative 0
+hw3fuse -timeout 60 -negative 60
+hw3fuse -timeout 60 -negative 60 -writeback
+hw3ll -timeout 0
+hw3ll -timeout 60
+EOF
+rm -f $IMG
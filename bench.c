@@ -0,0 +1,914 @@
+/*
+ * file:        bench.c
+ * description: micro-benchmarks that call fs_ops directly against
+ *              bench.img (no FUSE mount needed) and report block I/O
+ *              counts and time per operation.
+ *
+ *  usage: ./bench [-n iterations] [-cache N] [-dcache N] [-discard] [-threads N]
+ *               [-files N] [-mmap] [-uring] [-readahead N] [-cold] [-trace] [-json]
+ *              -n      - passes over each workload (default 1000;
+ *                        the I/O workloads do n/10 passes)
+ *              -cache  - block cache size in blocks (0 = off)
+ *              -dcache - dentry cache size in entries (0 = off)
+ *              -discard - punch freed blocks out of bench.img
+ *              -threads - largest thread count for the parallel
+ *                        workloads (default 4; runs 1, 2, 4 .. N)
+ *              -files  - files in the big-directory workload
+ *                        (default 5000)
+ *              -mmap   - map bench.img instead of using the block cache
+ *              -uring  - batch block I/O requests with io_uring
+ *              -readahead - largest read-ahead window in blocks
+ *                        (default 256, 0 = off)
+ *              -cold   - drop the kernel page cache too before each
+ *                        cold pass, so reads go to the disk (needs root)
+ *              -trace  - trace every fs_ops call and print per-operation
+ *                        latency percentiles and I/O at the end
+ *              -json   - print the results as one JSON document, with
+ *                        ops/sec, block I/O per op and latency
+ *                        percentiles for each workload (other
+ *                        remarks go to stderr)
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fuse.h>
+#include <sys/statvfs.h>
+#include <pthread.h>
+
+#include "fs5600.h"
+
+extern struct fuse_operations fs_ops;
+extern void block_init(char *file);
+extern void block_get_stats(struct block_stats *st);
+extern void block_reset_stats(void);
+extern int block_flush(int sync);
+extern void dcache_get_stats(struct dcache_stats *st);
+extern int block_cache_capacity;
+extern int dcache_capacity;
+extern int block_discard_enabled;
+extern int block_mmap_enabled;
+extern int block_uring_enabled;
+extern int readahead_max;
+extern int set_durability(const char *name);
+extern void trace_install(char *file);
+extern void trace_dump(FILE *fp);
+extern void trace_reset(void);
+extern void trace_get_total(struct trace_stats *st);
+
+/* same context mockup as unittest-2
+ */
+struct fuse_context ctx = {.uid = 500, .gid = 500};
+struct fuse_context *fuse_get_context(void) {
+    return &ctx;
+}
+
+/* every file and directory in bench.in, depth 0 to 3
+ */
+char *stat_paths[] = {
+    "/", "/file.1k", "/file.10", "/file.8k+", "/dir-with-long-name",
+    "/dir-with-long-name/file.12k+", "/dir2", "/dir2/twenty-seven-byte-file-name",
+    "/dir2/file.4k+", "/dir3", "/dir3/subdir", "/dir3/subdir/file.4k-",
+    "/dir3/subdir/file.8k-", "/dir3/subdir/file.12k", "/dir3/file.12k-", NULL};
+
+double now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int json = 0;
+FILE *notes;                    /* remarks: stdout, or stderr with -json */
+
+/* zero the block counters, and with -json the latency histograms
+ */
+void reset_stats(void)
+{
+    block_reset_stats();
+    if (json) {
+        trace_reset();
+    }
+}
+
+void reset_disk(void)
+{
+    system("python gen-disk.py -q bench.in bench.img");
+    fs_ops.init(NULL);
+    reset_stats();
+}
+
+int cold = 0;
+
+/* write back everything and drop all caches, as after a remount, and
+ * with -cold the kernel's page cache too
+ */
+void drop_caches(void)
+{
+    block_flush(1);
+    if (cold) {
+        system("sync; echo 3 > /proc/sys/vm/drop_caches");
+    }
+    fs_ops.init(NULL);
+    reset_stats();
+}
+
+/* one element of the "results" array. 'bs' is NULL for workloads
+ * that don't go through fs_ops; otherwise the latency percentiles are
+ * over every fs_ops call since the last reset_stats().
+ */
+int json_results = 0;
+
+void json_result(const char *name, int nops, double usec, double bytes,
+                 struct block_stats *bs)
+{
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"usec_per_op\": %.3f, "
+           "\"ops_per_sec\": %.1f", json_results++ ? "," : "", name, nops,
+           usec / nops, nops / (usec / 1e6));
+    if (bytes > 0) {
+        printf(", \"mb_per_sec\": %.1f", bytes / usec);
+    }
+    if (bs != NULL) {
+        printf(", \"block_reads_per_op\": %.3f, \"block_writes_per_op\": %.3f, "
+               "\"dev_reads_per_op\": %.3f, \"dev_writes_per_op\": %.3f, "
+               "\"syncs_per_op\": %.4f, \"commits_per_op\": %.4f",
+               (double)bs->reads / nops, (double)bs->writes / nops,
+               (double)bs->dev_reads / nops, (double)bs->dev_writes / nops,
+               (double)bs->syncs / nops, (double)bs->commits / nops);
+        struct trace_stats ts;
+        trace_get_total(&ts);
+        if (ts.calls > 0) {
+            printf(", \"fs_calls\": %lu, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                   "\"p999_us\": %.2f, \"max_us\": %.2f", ts.calls,
+                   ts.p50_ns / 1e3, ts.p99_ns / 1e3, ts.p999_ns / 1e3, ts.max_ns / 1e3);
+        }
+    }
+    printf("}");
+    fflush(stdout);
+}
+
+/* print per-op block I/O for 'nops' operations since the last reset,
+ * plus throughput if 'bytes' is non-zero
+ */
+void report(const char *name, int nops, double usec, double bytes)
+{
+    struct block_stats bs;
+    block_get_stats(&bs);
+    if (json) {
+        json_result(name, nops, usec, bytes, &bs);
+        reset_stats();
+        return;
+    }
+    printf("%-12s %8d ops  %8.2f us/op  block_read/op %6.2f  "
+           "dev reads/op %6.2f  dev writes/op %6.2f",
+           name, nops, usec / nops, (double)bs.reads / nops,
+           (double)bs.dev_reads / nops, (double)bs.dev_writes / nops);
+    if (bytes > 0) {
+        printf("  %8.1f MB/s", bytes / usec);
+    }
+    if (bs.dev_batches > 0) {
+        printf("  batches/op %6.2f", (double)bs.dev_batches / nops);
+    }
+    if (bs.ra_blocks > 0) {
+        printf("  read ahead %lu, used %lu", bs.ra_blocks, bs.ra_hits);
+    }
+    if (bs.syncs > 0) {
+        printf("  syncs/op %6.3f", (double)bs.syncs / nops);
+    }
+    if (bs.commits > 0) {
+        printf("  commits/op %6.3f  logged/op %6.2f", (double)bs.commits / nops,
+               (double)bs.logged / nops);
+    }
+    printf("\n");
+    reset_stats();
+}
+
+/* stat every path once (cold caches), then 'iters' more times
+ */
+void bench_stat(int iters)
+{
+    struct stat sb;
+    int n = 0;
+
+    reset_disk();
+    double t0 = now_usec();
+    for (int i = 0; stat_paths[i] != NULL; i++, n++) {
+        fs_ops.getattr(stat_paths[i], &sb);
+    }
+    report("stat-cold", n, now_usec() - t0, 0);
+
+    n = 0;
+    t0 = now_usec();
+    for (int j = 0; j < iters; j++) {
+        for (int i = 0; stat_paths[i] != NULL; i++, n++) {
+            fs_ops.getattr(stat_paths[i], &sb);
+        }
+    }
+    report("stat", n, now_usec() - t0, 0);
+
+    struct dcache_stats ds;
+    dcache_get_stats(&ds);
+    fprintf(notes, "  dcache: %lu lookups, %lu hits, %lu negative, %lu misses, "
+           "%lu evictions, %d/%d entries\n", ds.lookups, ds.hits,
+           ds.neg_hits, ds.misses, ds.evictions, ds.entries, ds.capacity);
+}
+
+/* getattr of a file 'DEEP_LEVELS' directories down, so nearly all the
+ * work is the path walk: once with cold caches, then 'iters' times
+ */
+#define DEEP_LEVELS 8
+
+void bench_deep(int iters)
+{
+    char path[256] = "";
+    struct stat sb;
+
+    reset_disk();
+    for (int i = 0; i < DEEP_LEVELS; i++) {
+        sprintf(path + strlen(path), "/level-%d", i);
+        fs_ops.mkdir(path, 0777);
+    }
+    strcat(path, "/file");
+    fs_ops.create(path, 0100666, NULL);
+
+    drop_caches();
+    double t0 = now_usec();
+    fs_ops.getattr(path, &sb);
+    report("stat-deep-cold", 1, now_usec() - t0, 0);
+
+    t0 = now_usec();
+    for (int i = 0; i < iters; i++) {
+        if (fs_ops.getattr(path, &sb) != 0) {
+            printf("deep: getattr failed\n");
+            exit(1);
+        }
+    }
+    report("stat-deep", iters, now_usec() - t0, 0);
+}
+
+/* ~4 MB, the largest file before indirect blocks, rounded down to
+ * whole 128KB FUSE requests
+ */
+#define SEQ_FILE_SIZE (31 * 128 * 1024)
+
+/* write a ~4 MB file, then read it sequentially in 'chunk'-byte
+ * requests, dropping all caches before each pass. Every pass does the
+ * same I/O, so the block counts are from the last one and the time is
+ * the average.
+ */
+void bench_seqread(int iters, int chunk)
+{
+    char name[32];
+    char *buf = malloc(SEQ_FILE_SIZE);
+    memset(buf, 'x', SEQ_FILE_SIZE);
+
+    reset_disk();
+    fs_ops.create("/seq", 0100666, NULL);
+    for (int off = 0; off < SEQ_FILE_SIZE; off += 128 * 1024) {
+        fs_ops.write("/seq", buf + off, 128 * 1024, off, NULL);
+    }
+
+    double usec = 0;
+    int n = 0;
+    for (int j = 0; j < iters; j++) {
+        memset(buf, 0, SEQ_FILE_SIZE);
+        drop_caches();
+        n = 0;
+        double t0 = now_usec();
+        for (int off = 0; off < SEQ_FILE_SIZE; off += chunk, n++) {
+            if (fs_ops.read("/seq", buf + off, chunk, off, NULL) != chunk) {
+                printf("seqread: short read at %d\n", off);
+                exit(1);
+            }
+        }
+        usec += now_usec() - t0;
+    }
+    for (int i = 0; i < SEQ_FILE_SIZE; i++) {
+        if (buf[i] != 'x') {
+            printf("seqread: bad data at %d\n", i);
+            exit(1);
+        }
+    }
+    sprintf(name, "seqread-%dk", chunk / 1024);
+    report(name, n, usec / iters, SEQ_FILE_SIZE);
+    free(buf);
+}
+
+/* `cat bigfile > /dev/null`: read a 16 MB file - twice the default
+ * block cache - front to back in 128KB requests with cold caches.
+ * This is the workload read-ahead is for; compare -readahead 0.
+ */
+#define CAT_FILE_SIZE (16 * 1024 * 1024)
+
+void bench_cat(int iters)
+{
+    int chunk = 128 * 1024;
+    char *buf = malloc(chunk);
+    memset(buf, 'x', chunk);
+
+    reset_disk();
+    fs_ops.create("/big", 0100666, NULL);
+    for (int off = 0; off < CAT_FILE_SIZE; off += chunk) {
+        fs_ops.write("/big", buf, chunk, off, NULL);
+    }
+
+    double usec = 0;
+    int n = 0;
+    for (int j = 0; j < iters; j++) {
+        drop_caches();
+        n = 0;
+        double t0 = now_usec();
+        for (int off = 0; off < CAT_FILE_SIZE; off += chunk, n++) {
+            if (fs_ops.read("/big", buf, chunk, off, NULL) != chunk) {
+                printf("cat: short read at %d\n", off);
+                exit(1);
+            }
+        }
+        usec += now_usec() - t0;
+    }
+    report("cat-16m", n, usec / iters, CAT_FILE_SIZE);
+    free(buf);
+}
+
+/* 8 files written a block at a time in turn, so every block of each
+ * is in a separate place on disk. Time the flush of all of them (one
+ * write per block), then reading each back in 128KB requests with
+ * cold caches (one read per block). These are the workloads that
+ * -uring batches. Block counts are from the last pass.
+ */
+#define FRAG_FILES 8
+#define FRAG_BLOCKS 256
+
+void bench_fragread(int iters)
+{
+    char path[32], *buf = malloc(FRAG_BLOCKS * FS_BLOCK_SIZE);
+    memset(buf, 'f', FRAG_BLOCKS * FS_BLOCK_SIZE);
+    double wusec = 0, rusec = 0;
+    int n = 0;
+
+    for (int j = 0; j < iters; j++) {
+        reset_disk();
+        for (int f = 0; f < FRAG_FILES; f++) {
+            sprintf(path, "/frag%d", f);
+            fs_ops.create(path, 0100666, NULL);
+        }
+        block_flush(1);
+        for (int b = 0; b < FRAG_BLOCKS; b++) {
+            for (int f = 0; f < FRAG_FILES; f++) {
+                sprintf(path, "/frag%d", f);
+                fs_ops.write(path, buf, FS_BLOCK_SIZE, b * FS_BLOCK_SIZE, NULL);
+            }
+        }
+        reset_stats();
+        double t0 = now_usec();
+        block_flush(1);
+        wusec += now_usec() - t0;
+        if (j == iters - 1) {
+            report("fragflush", 1, wusec / iters, 0);
+        }
+
+        drop_caches();
+        n = 0;
+        t0 = now_usec();
+        for (int f = 0; f < FRAG_FILES; f++) {
+            sprintf(path, "/frag%d", f);
+            for (int off = 0; off < FRAG_BLOCKS * FS_BLOCK_SIZE; off += 128 * 1024, n++) {
+                fs_ops.read(path, buf, 128 * 1024, off, NULL);
+            }
+        }
+        rusec += now_usec() - t0;
+    }
+    report("fragread-128k", n, rusec / iters, (double)FRAG_FILES * FRAG_BLOCKS * FS_BLOCK_SIZE);
+    free(buf);
+}
+
+/* write a ~4 MB file sequentially in 'chunk'-byte requests on a fresh
+ * image, timing the writes plus the final durable flush. Block counts
+ * are from the last pass, the time is the average.
+ */
+void bench_seqwrite(int iters, int chunk)
+{
+    char name[32];
+    char *buf = malloc(SEQ_FILE_SIZE);
+    memset(buf, 'x', SEQ_FILE_SIZE);
+
+    double usec = 0;
+    int n = 0;
+    for (int j = 0; j < iters; j++) {
+        reset_disk();
+        fs_ops.create("/seq", 0100666, NULL);
+        block_flush(1);
+        reset_stats();
+        n = 0;
+        double t0 = now_usec();
+        for (int off = 0; off < SEQ_FILE_SIZE; off += chunk, n++) {
+            if (fs_ops.write("/seq", buf + off, chunk, off, NULL) != chunk) {
+                printf("seqwrite: write failed at %d\n", off);
+                exit(1);
+            }
+        }
+        block_flush(1);
+        usec += now_usec() - t0;
+    }
+    sprintf(name, "seqwrite-%dk", chunk / 1024);
+    report(name, n, usec / iters, SEQ_FILE_SIZE);
+    free(buf);
+}
+
+/* write a ~4 MB file and flush it, then time deleting it (including
+ * the durable flush that follows). Block counts are from the last
+ * pass, the time is the average.
+ */
+void bench_delete(int iters)
+{
+    char *buf = calloc(1, SEQ_FILE_SIZE);
+    struct block_stats bs;
+    double usec = 0;
+
+    reset_disk();
+    for (int j = 0; j < iters; j++) {
+        fs_ops.create("/seq", 0100666, NULL);
+        fs_ops.write("/seq", buf, SEQ_FILE_SIZE, 0, NULL);
+        block_flush(1);
+        reset_stats();
+        double t0 = now_usec();
+        fs_ops.unlink("/seq");
+        block_flush(1);
+        usec += now_usec() - t0;
+    }
+    block_get_stats(&bs);
+    report("delete-4m", 1, usec / iters, 0);
+    if (block_discard_enabled) {
+        fprintf(notes, "  discarded %lu blocks\n", bs.discards);
+    }
+    free(buf);
+}
+
+/* fill the disk ('image', a .in file) to within 'left' blocks of full,
+ * then time 'iters' rounds of create / 4K write / unlink, and statfs
+ * calls. Names get a suffix from the image, e.g. alloc-full-big,
+ * except for bench.in.
+ */
+void bench_alloc(const char *image, int iters, int left)
+{
+    struct statvfs st;
+    char path[32], cmd[64], name[32], sfx[16] = "";
+    char *buf = calloc(1, 1000 * FS_BLOCK_SIZE);
+
+    if (strcmp(image, "bench.in") != 0) {
+        snprintf(sfx, sizeof(sfx), "-%.*s", (int)strcspn(image, "."), image);
+    }
+
+    sprintf(cmd, "python gen-disk.py -q %s bench.img", image);
+    system(cmd);
+    fs_ops.init(NULL);
+    reset_stats();
+    fs_ops.statfs("/", &st);
+    for (int i = 0; st.f_bfree > left + 1; i++) {
+        int nblks = (st.f_bfree - left - 1 < 1000) ? st.f_bfree - left - 1 : 1000;
+        sprintf(path, "/fill%d", i);
+        fs_ops.create(path, 0100666, NULL);
+        fs_ops.write(path, buf, nblks * FS_BLOCK_SIZE, 0, NULL);
+        fs_ops.statfs("/", &st);
+    }
+    reset_stats();
+
+    double t0 = now_usec();
+    for (int i = 0; i < iters; i++) {
+        if (fs_ops.create("/a", 0100666, NULL) != 0 ||
+            fs_ops.write("/a", buf, FS_BLOCK_SIZE, 0, NULL) != FS_BLOCK_SIZE) {
+            printf("alloc: failed at %d\n", i);
+            exit(1);
+        }
+        fs_ops.unlink("/a");
+    }
+    fprintf(notes, "%s, %lu blocks:\n", image, (unsigned long)st.f_blocks);
+    sprintf(name, "alloc-full%s", sfx);
+    report(name, iters, now_usec() - t0, 0);
+
+    t0 = now_usec();
+    for (int i = 0; i < iters; i++) {
+        fs_ops.statfs("/", &st);
+    }
+    sprintf(name, "statfs%s", sfx);
+    report(name, iters, now_usec() - t0, 0);
+    free(buf);
+}
+
+/* readdir filler that saves the names
+ */
+struct name_list {
+    int n, max;
+    char (*names)[32];
+};
+
+int list_filler(void *ptr, const char *name, const struct stat *st, off_t off)
+{
+    struct name_list *l = ptr;
+    if (l->n < l->max) {
+        strcpy(l->names[l->n++], name);
+    }
+    return 0;
+}
+
+/* create 'nfiles' files in one directory; list it and stat every
+ * entry ("ls -l") and look each one up, both with cold caches; then
+ * delete them all. The bench image has hashed directories, so each
+ * lookup reads the inode and one directory block however big the
+ * directory gets.
+ */
+void bench_dir(int nfiles)
+{
+    char path[64];
+    struct stat sb;
+    struct name_list l = {0, nfiles, malloc(nfiles * 32)};
+
+    reset_disk();
+    fs_ops.mkdir("/big", 0777);
+    block_flush(1);
+    reset_stats();
+
+    double t0 = now_usec();
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/big/f%d", i);
+        if (fs_ops.create(path, 0100666, NULL) != 0) {
+            printf("dir: create failed at %d\n", i);
+            exit(1);
+        }
+    }
+    report("dir-create", nfiles, now_usec() - t0, 0);
+
+    drop_caches();
+    t0 = now_usec();
+    fs_ops.readdir("/big", &l, list_filler, 0, NULL);
+    for (int i = 0; i < l.n; i++) {
+        sprintf(path, "/big/%s", l.names[i]);
+        fs_ops.getattr(path, &sb);
+    }
+    report("dir-ls", l.n, now_usec() - t0, 0);
+    free(l.names);
+
+    drop_caches();
+    t0 = now_usec();
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/big/f%d", (i * 7919) % nfiles);
+        if (fs_ops.getattr(path, &sb) != 0) {
+            printf("dir: lookup failed at %d\n", i);
+            exit(1);
+        }
+    }
+    report("dir-lookup", nfiles, now_usec() - t0, 0);
+
+    t0 = now_usec();
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/big/f%d", i);
+        fs_ops.unlink(path);
+    }
+    report("dir-unlink", nfiles, now_usec() - t0, 0);
+}
+
+/* "ls -l" of a full directory on an image in the original format (one
+ * block per inode, one block per directory): 128 files with a little
+ * data each, listed and stat'ed with cold caches
+ */
+#define FULL_DIR_FILES 128
+
+void bench_dir_full(void)
+{
+    char path[64];
+    struct stat sb;
+    struct name_list l = {0, FULL_DIR_FILES, malloc(FULL_DIR_FILES * 32)};
+
+    system("python gen-disk.py -q disk2.in bench.img");
+    fs_ops.init(NULL);
+    fs_ops.mkdir("/full", 0777);
+    for (int i = 0; i < FULL_DIR_FILES; i++) {
+        sprintf(path, "/full/f%d", i);
+        fs_ops.create(path, 0100666, NULL);
+        fs_ops.write(path, path, strlen(path), 0, NULL);
+    }
+
+    drop_caches();
+    double t0 = now_usec();
+    fs_ops.readdir("/full", &l, list_filler, 0, NULL);
+    for (int i = 0; i < l.n; i++) {
+        sprintf(path, "/full/%s", l.names[i]);
+        fs_ops.getattr(path, &sb);
+    }
+    report("dir-ls-full", l.n, now_usec() - t0, 0);
+    free(l.names);
+}
+
+/* durable file creation. Without a journal the only safe way is a
+ * synced flush after every create; with one (journal.in) creates are
+ * committed in groups, and several threads creating at once share
+ * commits too
+ */
+#define JRNL_FILES 2000
+
+struct jrnl_job {
+    int id, nfiles;
+};
+
+void *jrnl_worker(void *arg)
+{
+    struct jrnl_job *job = arg;
+    char path[32];
+    for (int i = 0; i < job->nfiles; i++) {
+        sprintf(path, "/j%d/f%d", job->id, i);
+        fs_ops.create(path, 0100666, NULL);
+        fs_ops.write(path, path, strlen(path), 0, NULL);
+    }
+    return NULL;
+}
+
+void bench_journal(int maxthreads)
+{
+    char path[32], name[32];
+
+    reset_disk();
+    fs_ops.mkdir("/j0", 0777);
+    double t0 = now_usec();
+    for (int i = 0; i < JRNL_FILES; i++) {
+        sprintf(path, "/j0/f%d", i);
+        fs_ops.create(path, 0100666, NULL);
+        fs_ops.write(path, path, strlen(path), 0, NULL);
+        block_flush(1);
+    }
+    report("create-sync", JRNL_FILES, now_usec() - t0, 0);
+
+    for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+        pthread_t tids[nthreads];
+        struct jrnl_job jobs[nthreads];
+        system("python gen-disk.py -q journal.in bench.img");
+        fs_ops.init(NULL);
+        for (int t = 0; t < nthreads; t++) {
+            sprintf(path, "/j%d", t);
+            fs_ops.mkdir(path, 0777);
+        }
+        block_flush(1);
+        reset_stats();
+        t0 = now_usec();
+        for (int t = 0; t < nthreads; t++) {
+            jobs[t] = (struct jrnl_job){.id = t, .nfiles = JRNL_FILES / nthreads};
+            pthread_create(&tids[t], NULL, jrnl_worker, &jobs[t]);
+        }
+        for (int t = 0; t < nthreads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        block_flush(1);
+        sprintf(name, "create-jrnl-%dt", nthreads);
+        report(name, JRNL_FILES, now_usec() - t0, 0);
+    }
+    fs_ops.destroy(NULL);
+}
+
+/* fsync of one file while others have dirty data too, which only
+ * writes back that file's blocks, against a full flush; then creates
+ * with -durability sync, with and without a journal
+ */
+#define FSYNC_FILES 16
+#define FSYNC_SIZE (64 * 1024)
+
+void bench_fsync(int iters)
+{
+    char path[32], cmd[64];
+    char *buf = malloc(FSYNC_SIZE);
+    memset(buf, 'f', FSYNC_SIZE);
+
+    reset_disk();
+    for (int i = 0; i < FSYNC_FILES; i++) {
+        sprintf(path, "/fs%d", i);
+        fs_ops.create(path, 0100666, NULL);
+    }
+    for (int full = 0; full < 2; full++) {
+        block_flush(1);
+        reset_stats();
+        double usec = 0;
+        for (int j = 0; j < iters; j++) {
+            for (int i = 0; i < FSYNC_FILES; i++) {
+                sprintf(path, "/fs%d", i);
+                fs_ops.write(path, buf, FSYNC_SIZE, 0, NULL);
+            }
+            double t0 = now_usec();
+            if (full) {
+                block_flush(1);
+            } else {
+                fs_ops.fsync("/fs0", 0, NULL);
+            }
+            usec += now_usec() - t0;
+        }
+        report(full ? "flush-all" : "fsync-1", iters, usec, 0);
+    }
+
+    char *images[] = {"bench.in", "journal.in"};
+    set_durability("sync");
+    for (int k = 0; k < 2; k++) {
+        sprintf(cmd, "python gen-disk.py -q %s bench.img", images[k]);
+        system(cmd);
+        fs_ops.init(NULL);
+        reset_stats();
+        double t0 = now_usec();
+        for (int i = 0; i < JRNL_FILES / 4; i++) {
+            sprintf(path, "/s%d", i);
+            fs_ops.create(path, 0100666, NULL);
+        }
+        report(k ? "create-dsync-j" : "create-dsync", JRNL_FILES / 4, now_usec() - t0, 0);
+        fs_ops.destroy(NULL);
+    }
+    set_durability("fsync");
+    free(buf);
+}
+
+/* fio-style parallel I/O: each thread does random 'size'-byte reads
+ * or (block-aligned) overwrites on its own 1 MB file
+ */
+#define PAR_FILE_BLOCKS 256
+
+struct par_job {
+    int id, ops, write, size;
+};
+
+void *par_worker(void *arg)
+{
+    struct par_job *job = arg;
+    char path[32], *buf = malloc(job->size);
+    int nblks = job->size / FS_BLOCK_SIZE;
+    unsigned seed = job->id + 1;
+
+    sprintf(path, "/par%d", job->id);
+    memset(buf, 'a' + job->id % 26, job->size);
+    for (int i = 0; i < job->ops; i++) {
+        off_t off = (off_t)(rand_r(&seed) % (PAR_FILE_BLOCKS - nblks + 1)) * FS_BLOCK_SIZE;
+        int n = job->write ? fs_ops.write(path, buf, job->size, off, NULL)
+                           : fs_ops.read(path, buf, job->size, off, NULL);
+        if (n != job->size) {
+            printf("parallel: %s failed at %ld\n", job->write ? "write" : "read", (long)off);
+            exit(1);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+void bench_parallel(int maxthreads, int ops, int write, int size)
+{
+    char path[32], name[32];
+    char *buf = calloc(PAR_FILE_BLOCKS, FS_BLOCK_SIZE);
+
+    reset_disk();
+    for (int t = 0; t < maxthreads; t++) {
+        sprintf(path, "/par%d", t);
+        fs_ops.create(path, 0100666, NULL);
+        fs_ops.write(path, buf, PAR_FILE_BLOCKS * FS_BLOCK_SIZE, 0, NULL);
+    }
+
+    for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+        pthread_t tids[nthreads];
+        struct par_job jobs[nthreads];
+        reset_stats();
+        double t0 = now_usec();
+        for (int t = 0; t < nthreads; t++) {
+            jobs[t] = (struct par_job){.id = t, .ops = ops, .write = write, .size = size};
+            pthread_create(&tids[t], NULL, par_worker, &jobs[t]);
+        }
+        for (int t = 0; t < nthreads; t++) {
+            pthread_join(tids[t], NULL);
+        }
+        double usec = now_usec() - t0;
+        if (size == FS_BLOCK_SIZE) {
+            sprintf(name, "rand%s-%dt", write ? "write" : "read", nthreads);
+        } else {
+            sprintf(name, "rand%s-%dk-%dt", write ? "write" : "read", size / 1024, nthreads);
+        }
+        report(name, nthreads * ops, usec, (double)nthreads * ops * size);
+        fprintf(notes, "  %.0f IOPS\n", nthreads * ops / (usec / 1e6));
+    }
+    free(buf);
+}
+
+/* the same writes straight to a scratch file, as a 'dd' baseline
+ */
+void bench_rawwrite(int iters, int chunk)
+{
+    char name[32];
+    char *buf = malloc(chunk);
+    memset(buf, 'x', chunk);
+
+    double usec = 0;
+    for (int j = 0; j < iters; j++) {
+        int fd = open("bench-raw.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        double t0 = now_usec();
+        for (int off = 0; off < SEQ_FILE_SIZE; off += chunk) {
+            if (pwrite(fd, buf, chunk, off) != chunk) {
+                printf("rawwrite: write failed at %d\n", off);
+                exit(1);
+            }
+        }
+        fsync(fd);
+        usec += now_usec() - t0;
+        close(fd);
+    }
+    unlink("bench-raw.tmp");
+    sprintf(name, "rawwrite-%dk", chunk / 1024);
+    if (json) {
+        json_result(name, SEQ_FILE_SIZE / chunk, usec / iters, SEQ_FILE_SIZE, NULL);
+        free(buf);
+        return;
+    }
+    printf("%-12s %8d ops  %8.2f us/op  %63s  %8.1f MB/s\n", name,
+           SEQ_FILE_SIZE / chunk, usec / iters / (SEQ_FILE_SIZE / chunk), "",
+           SEQ_FILE_SIZE / (usec / iters));
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = 1000, threads = 4, nfiles = 5000, trace = 0;
+
+    notes = stdout;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iters = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc) {
+            block_cache_capacity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-dcache") == 0 && i + 1 < argc) {
+            dcache_capacity = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-discard") == 0) {
+            block_discard_enabled = 1;
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-files") == 0 && i + 1 < argc) {
+            nfiles = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-mmap") == 0) {
+            block_mmap_enabled = 1;
+        } else if (strcmp(argv[i], "-uring") == 0) {
+            block_uring_enabled = 1;
+        } else if (strcmp(argv[i], "-readahead") == 0 && i + 1 < argc) {
+            readahead_max = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-cold") == 0) {
+            cold = 1;
+        } else if (strcmp(argv[i], "-trace") == 0) {
+            trace = 1;
+        } else if (strcmp(argv[i], "-json") == 0) {
+            json = 1;
+            notes = stderr;
+        } else {
+            printf("usage: %s [-n iterations] [-cache N] [-dcache N] [-discard] "
+                   "[-threads N] [-files N] [-mmap] [-uring] [-readahead N] [-cold] [-trace] "
+                   "[-json]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (trace || json) {
+        trace_install(NULL);
+    }
+    if (json) {
+        printf("{\n  \"config\": {\"iterations\": %d, \"cache\": %d, \"dcache\": %d, "
+               "\"threads\": %d, \"files\": %d, \"mmap\": %d, \"uring\": %d, "
+               "\"readahead\": %d, \"discard\": %d, \"cold\": %d},\n  \"results\": [",
+               iters, block_cache_capacity, dcache_capacity, threads, nfiles,
+               block_mmap_enabled, block_uring_enabled, readahead_max,
+               block_discard_enabled, cold);
+    }
+    system("python gen-disk.py -q bench.in bench.img");
+    block_init("bench.img");
+
+    bench_stat(iters);
+    bench_deep(iters);
+
+    int io_iters = (iters >= 10) ? iters / 10 : 1;
+    bench_seqread(io_iters, 4 * 1024);
+    bench_seqread(io_iters, 128 * 1024);
+    bench_cat(io_iters);
+    bench_seqwrite(io_iters, 4 * 1024);
+    bench_seqwrite(io_iters, 128 * 1024);
+    bench_rawwrite(io_iters, 128 * 1024);
+    bench_fragread(io_iters);
+    bench_delete(io_iters);
+    bench_alloc("bench.in", iters, 512);
+    bench_alloc("big.in", iters, 512);
+    bench_dir(nfiles);
+    bench_dir_full();
+    bench_journal(threads);
+    bench_fsync(io_iters);
+    bench_parallel(threads, iters * 10, 0, FS_BLOCK_SIZE);
+    bench_parallel(threads, iters * 10, 1, FS_BLOCK_SIZE);
+    bench_parallel(threads, iters, 0, 64 * 1024);
+    bench_parallel(threads, iters, 1, 64 * 1024);
+    if (json) {
+        printf("\n  ]\n}\n");
+    } else if (trace) {
+        trace_dump(stdout);
+    }
+    return 0;
+}
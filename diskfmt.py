@@ -2,6 +2,11 @@ from ctypes import *
 
 MAGIC = 0x30303635
 
+FEAT_DIR_HASH = 1
+FEAT_SMALL_INODES = 2
+FEAT_JOURNAL = 4
+FEAT_INDIRECT = 8
+
 class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
                 ("inode", c_uint, 31),
@@ -10,7 +15,32 @@ class dirent(Structure):
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("features", c_uint),
+                ("inode_map", c_uint),
+                ("inode_table", c_uint),
+                ("ninodes", c_uint),
+                ("bitmap", c_uint),
+                ("bitmap_blocks", c_uint),
+                ("journal", c_uint),
+                ("journal_blocks", c_uint),
+                ("_pad", c_char * 4056)]
+
+# one block bitmap block per 32768 blocks of disk
+GROUP_BLOCKS = 4096 * 8
+
+# a quarter of the journal has to hold what one operation dirties:
+# every bitmap block, plus a few (block_journal_room in the C code)
+def journal_min(nbitmap):
+    return max(64, 4 * (nbitmap + 8))
+
+# inode block pointers: ptrs[0..N_DIRECT-1] are data blocks, then the
+# single- and double-indirect pointer blocks. Without FEAT_INDIRECT
+# all N_PTRS are data blocks.
+PTRS_PER_BLK = 1024
+N_PTRS = 1019
+N_DIRECT = 1017
+IND_PTR = N_DIRECT
+DIND_PTR = N_DIRECT + 1
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -19,22 +49,89 @@ class inode(Structure):
                 ("ctime", c_uint),
                 ("mtime", c_uint),
                 ("size", c_int),
-                ("ptrs", c_uint * 1019)]
+                ("ptrs", c_uint * N_PTRS)]
+    n_direct, ind, dind = N_DIRECT, IND_PTR, DIND_PTR
+
+# FEAT_SMALL_INODES: 32 of these per inode table block
+SMALL_N_DIRECT = 25
+INODES_PER_BLK = 32
 
-class bitmap(Structure):
-    _fields_ = [("vals", c_uint * 1024)]
+class small_inode(Structure):
+    _fields_ = [("uid", c_ushort),
+                ("gid", c_ushort),
+                ("mode", c_uint),
+                ("ctime", c_uint),
+                ("mtime", c_uint),
+                ("size", c_int),
+                ("ptrs", c_uint * (SMALL_N_DIRECT + 2))]
+    n_direct, ind, dind = SMALL_N_DIRECT, SMALL_N_DIRECT, SMALL_N_DIRECT + 1
+
+# inode 'inum' from a list of disk blocks
+def get_inode(sb, blks, inum):
+    if sb.features & FEAT_SMALL_INODES:
+        blk = blks[sb.inode_table + inum // INODES_PER_BLK]
+        off = (inum % INODES_PER_BLK) * sizeof(small_inode)
+        return small_inode.from_buffer_copy(blk[off:off + sizeof(small_inode)])
+    i = inode.from_buffer_copy(blks[inum])
+    if not sb.features & FEAT_INDIRECT:
+        i.n_direct = N_PTRS
+    return i
+
+# a bitmap of one or more blocks, either new or from the bytes of its
+# blocks; bit i is bit i%8 of byte i/8
+class bitmap(object):
+    def __init__(self, data=None, nblocks=1):
+        self.data = bytearray(data) if data else bytearray(4096 * nblocks)
     def get(self, i):
-        n = self.vals[i // 32]
-        mask = 1 << (i % 32)
-        return (n & mask) != 0
+        return (self.data[i // 8] >> (i % 8)) & 1 != 0
     def set(self, i, val):
-        mask = 1 << (i % 32)
-        n = self.vals[i // 32]
         if val:
-            n = n | mask
+            self.data[i // 8] |= 1 << (i % 8)
         else:
-            n = n & (mask ^ 0xffffffff)
-        self.vals[i // 32] = n
+            self.data[i // 8] &= ~(1 << (i % 8)) & 0xff
+    def block(self, k):
+        return self.data[k*4096:(k+1)*4096]
+
+# (first block, number of blocks) of the block bitmap
+def bitmap_blocks(sb):
+    if sb.bitmap == 0:
+        return 1, 1
+    return sb.bitmap, sb.bitmap_blocks
+
+class ptrblock(Structure):
+    _fields_ = [("ptrs", c_uint * PTRS_PER_BLK)]
+
+# returns (data blocks, pointer blocks) of an inode; blks is the list of
+# disk blocks
+def file_blocks(_in, blks):
+    n = (_in.size + 4095) // 4096
+    data = list(_in.ptrs[:min(n, _in.n_direct)])
+    meta = []
+    n -= len(data)
+    if n > 0 and _in.ptrs[_in.ind]:
+        meta.append(_in.ptrs[_in.ind])
+        ind = ptrblock.from_buffer_copy(blks[_in.ptrs[_in.ind]])
+        data += ind.ptrs[:min(n, PTRS_PER_BLK)]
+        n -= PTRS_PER_BLK
+    if n > 0 and _in.ptrs[_in.dind]:
+        meta.append(_in.ptrs[_in.dind])
+        dind = ptrblock.from_buffer_copy(blks[_in.ptrs[_in.dind]])
+        for p in dind.ptrs:
+            if n <= 0 or p == 0:
+                break
+            meta.append(p)
+            ind = ptrblock.from_buffer_copy(blks[p])
+            data += ind.ptrs[:min(n, PTRS_PER_BLK)]
+            n -= PTRS_PER_BLK
+    return data, meta
+
+# name hash for FEAT_DIR_HASH directories (32-bit FNV-1a), must match
+# dir_hash() in homework.c
+def dir_hash(name):
+    h = 2166136261
+    for c in name.encode('ascii'):
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
 
 S_IFMT  = 0o0170000  # bit mask for the file type bit field
 S_IFREG = 0o0100000  # regular file
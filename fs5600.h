@@ -29,11 +29,59 @@ struct fs_dirent {
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
+    uint32_t features;          /* FS_FEAT_* flags, 0 on older images */
+
+    /* FS_FEAT_SMALL_INODES only */
+    uint32_t inode_map;         /* first inode bitmap block */
+    uint32_t inode_table;       /* first inode table block */
+    uint32_t ninodes;           /* inode table entries */
+
+    /* block bitmap location, one block per 32768 blocks of disk; 0
+     * on older images, which have one bitmap block at block 1
+     */
+    uint32_t bitmap;
+    uint32_t bitmap_blocks;
+
+    /* FS_FEAT_JOURNAL only: the metadata log, see misc.c */
+    uint32_t journal;
+    uint32_t journal_blocks;
     
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 10 * sizeof(uint32_t)]; 
 };
 
+/* directories are hash tables of 2^n blocks, see dir_hash() in
+ * homework.c
+ */
+#define FS_FEAT_DIR_HASH 1
+
+/* inodes are struct fs_small_inode entries in an inode table rather
+ * than a block each
+ */
+#define FS_FEAT_SMALL_INODES 2
+
+/* metadata changes are logged before they are written in place
+ */
+#define FS_FEAT_JOURNAL 4
+
+/* the last two pointers of a struct fs_inode are IND_PTR and DIND_PTR;
+ * without it all N_PTRS are direct, as in the original format. Small
+ * inodes always have the indirect pointers.
+ */
+#define FS_FEAT_INDIRECT 8
+
+/* Inode. The first N_DIRECT ptrs point at data blocks; ptrs[IND_PTR]
+ * points at a block of PTRS_PER_BLK more data block pointers, and
+ * ptrs[DIND_PTR] at a block of pointers to such blocks. Unused
+ * pointers are 0. On images without FS_FEAT_INDIRECT all N_PTRS
+ * point at data blocks.
+ */
+#define PTRS_PER_BLK (FS_BLOCK_SIZE / 4)
+#define N_PTRS (FS_BLOCK_SIZE/4 - 5)
+#define N_DIRECT (N_PTRS - 2)
+#define IND_PTR  N_DIRECT
+#define DIND_PTR (N_DIRECT + 1)
+
 struct fs_inode {
     uint16_t uid;
     uint16_t gid;
@@ -41,7 +89,83 @@ struct fs_inode {
     uint32_t ctime;
     uint32_t mtime;
     int32_t  size;
-    uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
+    uint32_t ptrs[N_PTRS];      /* inode = 4096 bytes */
+};
+
+/* Inode on FS_FEAT_SMALL_INODES images, INODES_PER_BLK to an inode
+ * table block. Same fields as struct fs_inode, but only SMALL_N_DIRECT
+ * direct pointers, followed by the single- and double-indirect ones.
+ */
+#define SMALL_N_DIRECT 25
+#define INODES_PER_BLK (FS_BLOCK_SIZE / sizeof(struct fs_small_inode))
+
+struct fs_small_inode {
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t mode;
+    uint32_t ctime;
+    uint32_t mtime;
+    int32_t  size;
+    uint32_t ptrs[SMALL_N_DIRECT + 2]; /* inode = 128 bytes */
+};
+
+/* dentry cache counters, see dcache_get_stats() in homework.c
+ */
+struct dcache_stats {
+    unsigned long lookups;
+    unsigned long hits;         /* positive entry found */
+    unsigned long neg_hits;     /* negative entry found (ENOENT) */
+    unsigned long misses;
+    unsigned long evictions;
+    int entries;
+    int capacity;
+};
+
+/* buffer cache counters, see block_get_stats() in misc.c
+ */
+struct block_stats {
+    unsigned long reads;        /* block_read calls */
+    unsigned long writes;       /* block_write calls */
+    unsigned long hits;         /* blocks found in the cache */
+    unsigned long misses;       /* blocks that had to be read */
+    unsigned long dev_reads;    /* read requests sent to the image */
+    unsigned long dev_writes;   /* write requests sent to the image */
+    unsigned long writebacks;   /* dirty blocks written back */
+    unsigned long dropped;      /* dirty blocks freed before write-back */
+    unsigned long discards;     /* blocks punched out of the image */
+    unsigned long evictions;
+    unsigned long dev_batches;  /* batches of requests sent at once */
+    unsigned long ra_blocks;    /* blocks read ahead */
+    unsigned long ra_hits;      /* ... and later read */
+    unsigned long ra_unused;    /* ... and dropped without being read */
+    unsigned long syncs;        /* fdatasync/msync calls */
+    unsigned long commits;      /* journal records written */
+    unsigned long logged;       /* ... and the metadata blocks in them */
+    unsigned long checkpoints;  /* times the log was emptied */
+    unsigned long extra;        /* buffers added to an all-pinned shard */
+    int dirty;
+    int capacity;
+};
+
+/* per-operation counters, see trace_get_stats() in trace.c
+ */
+struct trace_stats {
+    unsigned long calls;
+    unsigned long errors;       /* calls that returned < 0 */
+    unsigned long reads;        /* block_read calls, over all calls */
+    unsigned long writes;       /* block_write calls */
+    unsigned long dev_reads;
+    unsigned long dev_writes;
+    uint64_t total_ns;
+    uint64_t p50_ns, p99_ns, p999_ns, max_ns;
+};
+
+/* one extent for block_readv: nblks blocks from lba into buf
+ */
+struct block_req {
+    void *buf;
+    int lba;
+    int nblks;
 };
 
 #endif
@@ -15,21 +15,66 @@ if sys.argv[1] == '-q':
 
 chars = 'abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ'
 
+# block lists are comma-separated numbers or ranges, e.g. 10,12-20
+def parse_blocks(s):
+    val = []
+    for b in s.split(','):
+        if '-' in b:
+            lo,hi = b.split('-')
+            val += range(int(lo), int(hi)+1)
+        else:
+            val.append(int(b))
+    return val
+
+# inode format, fs.small_inode with the small_inodes feature
+inode_fmt = fs.inode
+
+# direct pointers go in the inode; beyond n_direct blocks the pointer
+# blocks are taken from unused blocks when the image is laid out
+def set_ptrs(i, f):
+    for j in range(min(len(f.blocks), i.n_direct)):
+        i.ptrs[j] = f.blocks[j]
+    if f.ind:
+        i.ptrs[i.ind] = f.ind.lba
+    if f.dind:
+        i.ptrs[i.dind] = f.dind.lba
+
+class ptrblock(object):
+    def __init__(self, ptrs):
+        self.name = 'ptrs'
+        self.ptrs = ptrs
+        self.lba = 0
+
+    def block(self, offset):
+        p = fs.ptrblock()
+        for j in range(len(self.ptrs)):
+            p.ptrs[j] = self.ptrs[j].lba if isinstance(self.ptrs[j], ptrblock) else self.ptrs[j]
+        return bytearray(p)
+
+def ptr_blocks(f):
+    f.ind, f.dind = None, None
+    rest = f.blocks[inode_fmt.n_direct:]
+    if rest:
+        f.ind = ptrblock(rest[:fs.PTRS_PER_BLK])
+        rest = rest[fs.PTRS_PER_BLK:]
+    if rest:
+        f.dind = ptrblock([ptrblock(rest[k:k+fs.PTRS_PER_BLK])
+                               for k in range(0, len(rest), fs.PTRS_PER_BLK)])
+    val = [f.ind, f.dind] + (f.dind.ptrs if f.dind else [])
+    return [p for p in val if p]
+
 class file(object):
     def __init__(self, fields):
         inum,self.name,self.uid,self.gid,self.mode,self.ctime,self.mtime,size,blocks = fields
         self.inum = int(inum)
         self.size = int(size)
-        self.blocks = list(map(int, blocks.split(',')))
+        self.blocks = parse_blocks(blocks)
 
     def inode(self):
-        i = fs.inode()
+        i = inode_fmt()
         i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
-
-
-        for j in range(len(self.blocks)):
-            i.ptrs[j] = self.blocks[j]
+        set_ptrs(i, self)
         return bytearray(i)
 
     def block(self,offset):
@@ -49,7 +94,7 @@ class dir(object):
         inum,self.name,self.uid,self.gid,self.mode,self.ctime,self.mtime,size,blocks = fields[0:9]
         self.inum = int(inum)
         self.size = int(size)
-        self.blocks = list(map(int, blocks.split(',')))
+        self.blocks = parse_blocks(blocks)
         entries = fields[9:]
         self.entries = []
         for e in fields[9:]:
@@ -62,31 +107,75 @@ class dir(object):
 #                print(name, int(inum))
 
     def inode(self):
-        i = fs.inode()
+        i = inode_fmt()
         i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
-        for j in range(len(self.blocks)):
-            i.ptrs[j] = self.blocks[j]
+        set_ptrs(i, self)
         return bytearray(i)
 
-    # dirent is 32 bytes, 128 per block
+    # dirent is 32 bytes, 128 per block. With FEAT_DIR_HASH the valid
+    # entries go in block dir_hash(name) % nblocks
     def block(self,offset):
         data = bytearray(4096)
         de = fs.dirent()
         j = 0
-        for i in range(offset*128, min(len(self.entries), (offset+1)*128)):
-            val,name,num = self.entries[i]
+        entries = self.entries[offset*128:(offset+1)*128]
+        if features & fs.FEAT_DIR_HASH:
+            n = len(self.blocks)
+            entries = [e for e in self.entries
+                           if e[0] and fs.dir_hash(e[1]) % n == offset]
+            if len(entries) > 128:
+                print('ERROR: directory block overflow', self.name, offset)
+        for val,name,num in entries:
             de.valid, de.inode, de.name = val, num, name.encode('ascii')
             data[j:j+32] = bytearray(de)
             j += 32
         return data
-        
+
+# FEAT_SMALL_INODES inode table and inode bitmap
+class itable(object):
+    def __init__(self, items):
+        self.name = 'inodes'
+        self.items = items
+
+    def block(self, offset):
+        data = bytearray(4096)
+        for f in self.items:
+            k = f.inum - offset * fs.INODES_PER_BLK
+            if 0 <= k < fs.INODES_PER_BLK:
+                data[k*128:(k+1)*128] = f.inode()
+        return data
+
+class imap(object):
+    def __init__(self, items, nblocks):
+        self.name = 'inode map'
+        self.map = fs.bitmap(nblocks=nblocks)
+        self.map.set(0, True)             # inode 0 and 1 are never used
+        self.map.set(1, True)
+        for f in items:
+            self.map.set(f.inum, True)
+
+    def block(self, offset):
+        return self.map.block(offset)
+
+# the block bitmap, filled in once the layout is done
+class bmap(object):
+    def __init__(self, m):
+        self.name = 'bitmap'
+        self.map = m
+
+    def block(self, offset):
+        return self.map.block(offset)
+
         
 syms = dict()
 files = []
 dirs = []
 nblocks = 0
 magic = 0x30303635
+features = 0
+ninodes = 0
+njournal = 0
 
 for line in open(sys.argv[1],'r'):
     fields = line.split()
@@ -101,6 +190,26 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'size':
         nblocks = int(fields[1])
         continue
+
+    if fields[0] == 'features':
+        for f in fields[1:]:
+            if f == 'dir_hash':
+                features |= fs.FEAT_DIR_HASH
+            elif f == 'small_inodes':
+                features |= fs.FEAT_SMALL_INODES
+                inode_fmt = fs.small_inode
+            else:
+                print('ERROR: unknown feature', f)
+        continue
+
+    if fields[0] == 'inodes':
+        ninodes = int(fields[1])
+        continue
+
+    if fields[0] == 'journal':
+        njournal = int(fields[1])
+        features |= fs.FEAT_JOURNAL
+        continue
     
     for i in range(len(fields)):
         if fields[i][0] == '$':
@@ -110,15 +219,55 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'dir':
         dirs.append(dir(fields[1:]))
 
-blockmap = fs.bitmap()
+# one bitmap block per fs.GROUP_BLOCKS blocks: a single one goes in
+# block 1 as always, more than that go at the end of the disk
+nbitmap = (nblocks + fs.GROUP_BLOCKS - 1) // fs.GROUP_BLOCKS
+blockmap = fs.bitmap(nblocks=nbitmap)
 blockmap.set(0,True)                      # superblock
-blockmap.set(1,True)                      # bitmap
 
-blocks = [None] * 400
+blocks = [None] * nblocks
+sb = fs.super()
+end = nblocks
+
+# with small_inodes, the inode bitmap and table go at the end of the
+# disk, so the block numbers in the .in file can stay as they are
+if features & fs.FEAT_SMALL_INODES:
+    ninodes = max(ninodes or nblocks // 2, max(f.inum for f in files + dirs) + 1)
+    ntable = (ninodes + fs.INODES_PER_BLK - 1) // fs.INODES_PER_BLK
+    sb.ninodes = ntable * fs.INODES_PER_BLK
+    nimap = (sb.ninodes + fs.GROUP_BLOCKS - 1) // fs.GROUP_BLOCKS
+    sb.inode_table = nblocks - ntable
+    sb.inode_map = sb.inode_table - nimap
+    end = sb.inode_map
+    table = itable(files + dirs)
+    for k in range(ntable):
+        blocks[sb.inode_table + k] = [table, k]
+        blockmap.set(sb.inode_table + k, True)
+    inomap = imap(files + dirs, nimap)
+    for k in range(nimap):
+        blocks[sb.inode_map + k] = [inomap, k]
+        blockmap.set(sb.inode_map + k, True)
+
+sb.bitmap = 1 if nbitmap == 1 else end - nbitmap
+sb.bitmap_blocks = nbitmap
+for k in range(nbitmap):
+    blocks[sb.bitmap + k] = [bmap(blockmap), k]
+    blockmap.set(sb.bitmap + k, True)
+
+# the journal goes below that; it starts out as zeros (an empty log)
+if njournal:
+    if njournal < fs.journal_min(nbitmap):
+        print('ERROR: journal needs at least', fs.journal_min(nbitmap), 'blocks')
+        sys.exit(1)
+    sb.journal = (end if nbitmap == 1 else sb.bitmap) - njournal
+    sb.journal_blocks = njournal
+    for k in range(njournal):
+        blockmap.set(sb.journal + k, True)
 
 for f in files + dirs:
-    blocks[f.inum] = [f]
-    blockmap.set(f.inum, True)
+    if not features & fs.FEAT_SMALL_INODES:
+        blocks[f.inum] = [f]
+        blockmap.set(f.inum, True)
     i = 0
     for b in f.blocks:
         if blockmap.get(b):
@@ -127,17 +276,35 @@ for f in files + dirs:
         blocks[b] = [f,i]
         i += 1
 
-sb = fs.super()
-sb.magic, sb.disk_sz = magic, nblocks
-zeros = bytearray(4096)
+# pointer blocks go in the lowest unused blocks
+ptrs = []
+for f in files + dirs:
+    ptrs += ptr_blocks(f)
+b = 2
+for p in ptrs:
+    while blocks[b]:
+        b += 1
+    p.lba = b
+    blockmap.set(b, True)
+    blocks[b] = [p,0]
+
+# files are always laid out with indirect pointers
+sb.magic, sb.disk_sz, sb.features = magic, nblocks, features | fs.FEAT_INDIRECT
 
+if features & fs.FEAT_DIR_HASH:
+    for d in dirs:
+        n = len(d.blocks)
+        if n & (n - 1) or d.size != n * 4096:
+            print('ERROR: hashed directory needs 2^k blocks', d.name)
+
+# unused blocks are left as holes
 fp = open(sys.argv[2], 'wb')
 fp.write(bytearray(sb))
-fp.write(bytearray(blockmap))
-for i in range(2,nblocks):
+for i in range(1,nblocks):
     if not blocks[i]:
-        fp.write(zeros)
-    elif len(blocks[i]) == 1:
+        continue
+    fp.seek(i * 4096)
+    if len(blocks[i]) == 1:
         filedir = blocks[i][0]
         fp.write(filedir.inode())
     else:
@@ -145,6 +312,7 @@ for i in range(2,nblocks):
         if not quiet:
             print('item ', item.name, ' offset', offset)
         fp.write(item.block(offset))
+fp.truncate(nblocks * 4096)
 fp.close()
 
 
@@ -8,11 +8,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
 #include <fuse.h>
 
 #include "fs5600.h"
 
 extern void block_init(char *file);
+extern int dcache_capacity;
+extern int block_cache_capacity;
+extern int block_flush_interval;
+extern int block_discard_enabled;
+extern int block_mmap_enabled;
+extern int block_uring_enabled;
+extern int readahead_max;
+extern int conn_writeback;
+extern int set_durability(const char *name);
+extern int fs_mount(void);
+extern void trace_install(char *file);
 
 /* All homework functions are accessed through the operations
  * structure.  
@@ -23,6 +37,18 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   dcache_size;
+    int   cache_size;
+    int   flush_secs;
+    int   discard;
+    int   mmap;
+    int   uring;
+    int   readahead;
+    int   writeback;
+    double timeout;
+    double negative;
+    char *durability;
+    char *trace_file;
 } _data;
 
 /**************/
@@ -31,12 +57,48 @@ struct data {
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
+ *  usage: ./homework -image disk.img [-dcache N] [-cache N] [-flush S] [-discard]
+ *                    [-mmap] [-uring] [-readahead N] [-durability MODE]
+ *                    [-trace FILE] directory
  *              disk.img  - name of the image file to mount
+ *              -dcache   - dentry cache size in entries (0 = off)
+ *              -cache    - block cache size in 4KB blocks (0 = off)
+ *              -flush    - write back dirty blocks every S seconds
+ *              -discard  - punch freed blocks out of the image file
+ *              -mmap     - map the image into memory instead of
+ *                          using the block cache (-cache is ignored)
+ *              -uring    - send batches of block I/O requests with
+ *                          io_uring, if the kernel allows it
+ *              -readahead - largest sequential read-ahead window, in
+ *                          4KB blocks (0 = off)
+ *              -timeout  - seconds the kernel may cache attributes and
+ *                          names without asking (default 60)
+ *              -negative - same for names that were not found (default 60)
+ *              -writeback - use the kernel's writeback cache, if libfuse
+ *                          supports it
+ *              -durability - none, fsync (default) or sync: when
+ *                          changes have to reach the image (homework.c)
+ *              -trace    - trace every operation (trace.c) and append
+ *                          a summary to FILE on SIGUSR1 and at unmount
  *              directory - directory to mount it on
+ *
+ * The timeouts go to libfuse as -o attr_timeout, entry_timeout and
+ * negative_timeout, ahead of any given on the command line, which win.
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-dcache %d", offsetof(struct data, dcache_size), 0},
+    {"-cache %d", offsetof(struct data, cache_size), 0},
+    {"-flush %d", offsetof(struct data, flush_secs), 0},
+    {"-discard", offsetof(struct data, discard), 1},
+    {"-mmap", offsetof(struct data, mmap), 1},
+    {"-uring", offsetof(struct data, uring), 1},
+    {"-readahead %d", offsetof(struct data, readahead), 0},
+    {"-timeout %lf", offsetof(struct data, timeout), 0},
+    {"-negative %lf", offsetof(struct data, negative), 0},
+    {"-writeback", offsetof(struct data, writeback), 1},
+    {"-durability %s", offsetof(struct data, durability), 0},
+    {"-trace %s", offsetof(struct data, trace_file), 0},
     FUSE_OPT_END
 };
 
@@ -45,10 +107,47 @@ int main(int argc, char **argv)
     /* Argument processing and checking
      */
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    _data.dcache_size = dcache_capacity;
+    _data.cache_size = block_cache_capacity;
+    _data.flush_secs = block_flush_interval;
+    _data.readahead = readahead_max;
+    _data.timeout = 60;
+    _data.negative = 60;
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1)
 	exit(1);
+    char timeouts[128];
+    snprintf(timeouts, sizeof(timeouts),
+             "-oattr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+             _data.timeout, _data.timeout, _data.negative);
+    fuse_opt_insert_arg(&args, 1, timeouts);
+    dcache_capacity = _data.dcache_size;
+    block_cache_capacity = _data.cache_size;
+    block_flush_interval = _data.flush_secs;
+    block_discard_enabled = _data.discard;
+    block_mmap_enabled = _data.mmap;
+    block_uring_enabled = _data.uring;
+    readahead_max = _data.readahead;
+    conn_writeback = _data.writeback;
+    if (_data.durability != NULL && set_durability(_data.durability) < 0) {
+        fprintf(stderr, "unknown durability mode: %s\n", _data.durability);
+        exit(1);
+    }
+
+    if (_data.trace_file != NULL) {
+        /* fuse_main chdirs to / when it goes into the background */
+        char *file = _data.trace_file, cwd[PATH_MAX];
+        if (file[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+            file = malloc(strlen(cwd) + strlen(file) + 2);
+            sprintf(file, "%s/%s", cwd, _data.trace_file);
+        }
+        trace_install(file);
+    }
 
     block_init(_data.image_name);
+    if (fs_mount() < 0) {
+        fprintf(stderr, "cannot mount %s\n", _data.image_name);
+        exit(1);
+    }
 
     return fuse_main(args.argc, args.argv, &fs_ops, NULL);
 }
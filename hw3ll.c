@@ -0,0 +1,498 @@
+/*
+ * file:        hw3ll.c
+ * description: main() for homework 3 on the FUSE low-level API
+ *
+ * hw3fuse hands every request to the kernel as a path, which the
+ * high-level library builds by walking its own table of names and
+ * which homework.c then walks again. Here the kernel talks to us in
+ * inode numbers: lookup(parent, name) once per name, then getattr,
+ * read, write etc. by number, using the inode-number interface at the
+ * end of homework.c. Replies carry attribute and entry timeouts
+ * (-timeout) so the kernel can answer repeated lookups and stats
+ * itself.
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include "fs5600.h"
+
+extern void block_init(char *file);
+extern int dcache_capacity;
+extern int block_cache_capacity;
+extern int block_flush_interval;
+extern int block_discard_enabled;
+extern int block_mmap_enabled;
+extern int block_uring_enabled;
+extern int readahead_max;
+extern int conn_writeback;
+extern int set_durability(const char *name);
+extern int fs_mount(void);
+
+extern struct fuse_operations fs_ops;
+
+extern void fs_set_caller(uid_t uid, gid_t gid);
+extern int fs_getattr_inum(int inum, struct stat *sb);
+extern int fs_lookup_at(int dir, const char *name, struct stat *sb);
+extern int fs_open_inum(int inum, struct fuse_file_info *fi, int dir);
+extern int fs_chmod_inum(int inum, mode_t mode);
+extern int fs_utime_inum(int inum, time_t mtime);
+extern int fs_truncate_inum(int inum, off_t len);
+extern int fs_create_at(int dir, const char *name, mode_t mode,
+                        struct fuse_file_info *fi);
+extern int fs_mkdir_at(int dir, const char *name, mode_t mode);
+extern int fs_unlink_at(int dir, const char *name);
+extern int fs_rmdir_at(int dir, const char *name);
+extern int fs_rename_at(int dir, const char *name, int newdir,
+                        const char *newname);
+extern size_t fs_readdir_reply_len(const size_t *ends, int n, off_t off, size_t size);
+
+struct data {
+    char  *image_name;
+    int    dcache_size;
+    int    cache_size;
+    int    flush_secs;
+    int    discard;
+    int    mmap;
+    int    uring;
+    int    readahead;
+    int    writeback;
+    char  *durability;
+    double timeout;
+} _data;
+
+/* FUSE's root is inode 1, ours is inode 2 (1 is never a file), so
+ * the two are swapped going either way.
+ */
+#define INO(x) ((x) == 2 ? 1 : (x) == 1 ? 2 : (x))
+
+static void reply_entry(fuse_req_t req, int inum, struct stat *sb,
+                        struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = INO(inum);
+    e.attr = *sb;
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = _data.timeout;
+    e.entry_timeout = _data.timeout;
+    if (fi != NULL) {
+        fuse_reply_create(req, &e, fi);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino)
+{
+    struct stat sb;
+    int rv = fs_getattr_inum(INO(ino), &sb);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    sb.st_ino = ino;
+    fuse_reply_attr(req, &sb, _data.timeout);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    fs_ops.init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+    fs_ops.destroy(userdata);
+}
+
+/* a lookup that fails is answered with inode 0, which the kernel
+ * remembers as a negative entry for the entry timeout.
+ */
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct stat sb;
+    int inum = fs_lookup_at(INO(parent), name, &sb);
+    if (inum == -ENOENT) {
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = _data.timeout;
+        fuse_reply_entry(req, &e);
+    } else if (inum < 0) {
+        fuse_reply_err(req, -inum);
+    } else {
+        reply_entry(req, inum, &sb, NULL);
+    }
+}
+
+/* nothing is kept per lookup, so forget has nothing to drop
+ */
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    reply_attr(req, ino);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi)
+{
+    int inum = INO(ino), rv = 0;
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        rv = fs_chmod_inum(inum, attr->st_mode);
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        if (fi != NULL) {
+            rv = fs_ops.ftruncate(NULL, attr->st_size, fi);
+        } else {
+            rv = fs_truncate_inum(inum, attr->st_size);
+        }
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW)) {
+        rv = fs_utime_inum(inum, time(NULL));
+    } else if (rv == 0 && (to_set & FUSE_SET_ATTR_MTIME)) {
+        rv = fs_utime_inum(inum, attr->st_mtime);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    reply_attr(req, ino);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct stat sb;
+    fs_set_caller(ctx->uid, ctx->gid);
+    int inum = fs_mkdir_at(INO(parent), name, mode);
+    if (inum < 0) {
+        fuse_reply_err(req, -inum);
+        return;
+    }
+    if (fs_getattr_inum(inum, &sb) < 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    reply_entry(req, inum, &sb, NULL);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct stat sb;
+    fs_set_caller(ctx->uid, ctx->gid);
+    int inum = fs_create_at(INO(parent), name, mode, fi);
+    if (inum < 0) {
+        fuse_reply_err(req, -inum);
+        return;
+    }
+    if (fs_getattr_inum(inum, &sb) < 0) {
+        fs_ops.release(NULL, fi);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    reply_entry(req, inum, &sb, fi);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -fs_unlink_at(INO(parent), name));
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -fs_rmdir_at(INO(parent), name));
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname)
+{
+    fuse_reply_err(req, -fs_rename_at(INO(parent), name, INO(newparent), newname));
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int rv = fs_open_inum(INO(ino), fi, 0);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    char *buf = malloc(size);
+    int rv = fs_ops.read(NULL, buf, size, off, fi);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_buf(req, buf, rv);
+    }
+    free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi)
+{
+    int rv = fs_ops.write(NULL, buf, size, off, fi);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_write(req, rv);
+    }
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -fs_ops.flush(NULL, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -fs_ops.release(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -fs_ops.fsync(NULL, datasync, fi));
+}
+
+/* Directories. The kernel reads a directory in pieces and hands back
+ * the offset of the last entry it took, so the whole listing is built
+ * once (at offset 0) and kept with the handle; each readdir returns
+ * the whole entries that fit after the offset. An entry's offset is
+ * where the next one starts, so 'ends' is also the list of offsets
+ * the kernel can ask for. fh holds this, and the core's own handle
+ * is inside it.
+ */
+struct ll_dir {
+    uint64_t core_fh;
+    char    *buf;
+    size_t   size;
+    size_t  *ends;
+    int      n;
+};
+
+struct dir_fill {
+    fuse_req_t     req;
+    struct ll_dir *d;
+};
+
+static int dir_filler(void *ptr, const char *name, const struct stat *sb,
+                      off_t off)
+{
+    struct dir_fill *df = ptr;
+    struct ll_dir *d = df->d;
+    struct stat st = *sb;
+    st.st_ino = INO(st.st_ino);
+
+    size_t len = fuse_add_direntry(df->req, NULL, 0, name, NULL, 0);
+    d->buf = realloc(d->buf, d->size + len);
+    fuse_add_direntry(df->req, d->buf + d->size, len, name, &st, d->size + len);
+    d->size += len;
+    d->ends = realloc(d->ends, (d->n + 1) * sizeof(*d->ends));
+    d->ends[d->n++] = d->size;
+    return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int rv = fs_open_inum(INO(ino), fi, 1);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    struct ll_dir *d = calloc(1, sizeof(*d));
+    d->core_fh = fi->fh;
+    fi->fh = (uintptr_t)d;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+    struct ll_dir *d = (struct ll_dir *)(uintptr_t)fi->fh;
+
+    if (off == 0) {
+        struct fuse_file_info core_fi = {.fh = d->core_fh};
+        struct dir_fill df = {.req = req, .d = d};
+        free(d->buf);
+        free(d->ends);
+        d->buf = NULL;
+        d->ends = NULL;
+        d->size = d->n = 0;
+        int rv = fs_ops.readdir(NULL, &df, dir_filler, 0, &core_fi);
+        if (rv < 0) {
+            fuse_reply_err(req, -rv);
+            return;
+        }
+    }
+    if (off >= d->size) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    fuse_reply_buf(req, d->buf + off, fs_readdir_reply_len(d->ends, d->n, off, size));
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct ll_dir *d = (struct ll_dir *)(uintptr_t)fi->fh;
+    struct fuse_file_info core_fi = {.fh = d->core_fh};
+    fs_ops.releasedir(NULL, &core_fi);
+    free(d->buf);
+    free(d->ends);
+    free(d);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                        struct fuse_file_info *fi)
+{
+    struct ll_dir *d = (struct ll_dir *)(uintptr_t)fi->fh;
+    struct fuse_file_info core_fi = {.fh = d->core_fh};
+    fuse_reply_err(req, -fs_ops.fsyncdir(NULL, datasync, &core_fi));
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+    int rv = fs_ops.statfs("/", &st);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_statfs(req, &st);
+    }
+}
+
+static struct fuse_lowlevel_ops ll_ops = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .rename = ll_rename,
+    .open = ll_open,
+    .read = ll_read,
+    .write = ll_write,
+    .flush = ll_flush,
+    .release = ll_release,
+    .fsync = ll_fsync,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .releasedir = ll_releasedir,
+    .fsyncdir = ll_fsyncdir,
+    .statfs = ll_statfs,
+    .create = ll_create,
+};
+
+/**************/
+
+/*
+ *  usage: ./hw3ll -image disk.img [-timeout S] [hw3fuse options] directory
+ *              -timeout  - seconds the kernel may keep attributes and
+ *                          names (found or not) without asking again;
+ *                          0 makes it ask every time (default 1)
+ *              -dcache, -cache, -flush, -discard, -mmap, -uring,
+ *              -readahead, -writeback, -durability - as for hw3fuse
+ */
+static struct fuse_opt opts[] = {
+    {"-image %s", offsetof(struct data, image_name), 0},
+    {"-timeout %lf", offsetof(struct data, timeout), 0},
+    {"-dcache %d", offsetof(struct data, dcache_size), 0},
+    {"-cache %d", offsetof(struct data, cache_size), 0},
+    {"-flush %d", offsetof(struct data, flush_secs), 0},
+    {"-discard", offsetof(struct data, discard), 1},
+    {"-mmap", offsetof(struct data, mmap), 1},
+    {"-uring", offsetof(struct data, uring), 1},
+    {"-readahead %d", offsetof(struct data, readahead), 0},
+    {"-writeback", offsetof(struct data, writeback), 1},
+    {"-durability %s", offsetof(struct data, durability), 0},
+    FUSE_OPT_END
+};
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    _data.dcache_size = dcache_capacity;
+    _data.cache_size = block_cache_capacity;
+    _data.flush_secs = block_flush_interval;
+    _data.readahead = readahead_max;
+    _data.timeout = 1.0;
+    if (fuse_opt_parse(&args, &_data, opts, NULL) == -1)
+	exit(1);
+    dcache_capacity = _data.dcache_size;
+    block_cache_capacity = _data.cache_size;
+    block_flush_interval = _data.flush_secs;
+    block_discard_enabled = _data.discard;
+    block_mmap_enabled = _data.mmap;
+    block_uring_enabled = _data.uring;
+    readahead_max = _data.readahead;
+    conn_writeback = _data.writeback;
+    if (_data.durability != NULL && set_durability(_data.durability) < 0) {
+        fprintf(stderr, "hw3ll: unknown durability mode %s\n", _data.durability);
+        exit(1);
+    }
+
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+        exit(1);
+    if (mountpoint == NULL) {
+        fprintf(stderr, "hw3ll: no mount point\n");
+        exit(1);
+    }
+
+    block_init(_data.image_name);
+    if (fs_mount() < 0) {
+        fprintf(stderr, "hw3ll: cannot mount %s\n", _data.image_name);
+        exit(1);
+    }
+
+    int err = 1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &ll_ops,
+                                                    sizeof(ll_ops), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                if (multithreaded) {
+                    err = fuse_session_loop_mt(se);
+                } else {
+                    err = fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    free(mountpoint);
+
+    return err ? 1 : 0;
+}
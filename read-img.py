@@ -18,7 +18,18 @@ print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
 print
 
-blkmap = fs.bitmap.from_buffer_copy(blks[1])
+first, n = fs.bitmap_blocks(sb)
+print ('            bitmap: %d-%d' % (first, first + n - 1))
+blkmap = fs.bitmap(b''.join(blks[first:first + n]))
+inomap = blkmap
+if sb.features & fs.FEAT_SMALL_INODES:
+    nimap = (sb.ninodes + fs.GROUP_BLOCKS - 1) // fs.GROUP_BLOCKS
+    print ('            inodes: %d, bitmap %d-%d, table %d-%d' %
+               (sb.ninodes, sb.inode_map, sb.inode_map + nimap - 1, sb.inode_table,
+                    sb.inode_table + sb.ninodes // fs.INODES_PER_BLK - 1))
+    inomap = fs.bitmap(b''.join(blks[sb.inode_map:sb.inode_map + nimap]))
+if sb.features & fs.FEAT_JOURNAL:
+    print ('           journal: %d-%d' % (sb.journal, sb.journal + sb.journal_blocks - 1))
 inodes = dict()
 
 print("blocks used:"),
@@ -37,11 +48,10 @@ names = dict()
 names[2] = ''
 
 def iter(name, inum, v):
-    assert inum < nblks
     children = []
     inodes[inum] = 1
-    _in = fs.inode.from_buffer_copy(blks[inum])
-    alloc = '' if blkmap.get(inum) else 'NOT MARKED IN BITMAP '
+    _in = fs.get_inode(sb, blks, inum)
+    alloc = '' if inomap.get(inum) else 'NOT MARKED IN BITMAP '
     s = '/' if name == '' else name
 
     if v:
@@ -49,21 +59,23 @@ def iter(name, inum, v):
         print ('  "%s" (%d,%d) %03o %d %s' % (s, _in.uid, _in.gid, _in.mode,
                                                  _in.size, alloc))
     
-    xblks = (_in.size + 4095) // 4096
+    data, meta = fs.file_blocks(_in, blks)
+    if v and meta:
+        print ('  pointer blocks: ' +
+                   ' '.join(str(b) + ('' if blkmap.get(b) else '(NOT ALLOCATED)') for b in meta))
     if fs.S_ISREG(_in.mode):
         if v:
             print ('  blocks: ', end='')
-        for i in range(xblks):
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+        for b in data:
+            alloc = '' if blkmap.get(b) else '(NOT ALLOCATED)'
             if v:
-                print (str(_in.ptrs[i]) + alloc, end=' '),
+                print (str(b) + alloc, end=' '),
         print("\n")
         if v:
             print
     elif fs.S_ISDIR(_in.mode):
-        for i in range(xblks):
-            dblk = _in.ptrs[i]
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+        for dblk in data:
+            alloc = '' if blkmap.get(dblk) else '(NOT ALLOCATED)'
             if v:
                 print ('  block', dblk, alloc)
             _blk = blks[dblk]
@@ -90,14 +102,13 @@ iter('', 2, False)
 print ("inodes found:")
 
 n,e = 0,''
-for i in range(nblks):
-    if i in inodes:
-        n += 1
-        if n == 16:
-            n = 0
-            print ('\n')
-        print (' %d' % i, end='')
-        e = ''
+for i in sorted(inodes):
+    n += 1
+    if n == 16:
+        n = 0
+        print ('\n')
+    print (' %d' % i, end='')
+    e = ''
 print ('\n')
 
 iter('', 2, True)
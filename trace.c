@@ -0,0 +1,427 @@
+/*
+ * file:        trace.c
+ * description: per-operation tracing for the fs_ops entry points:
+ *              call counts, block I/O per call and latency
+ *              histograms, dumped to a file on SIGUSR1 and at
+ *              unmount (hw3fuse -trace FILE, bench -trace)
+ *
+ * trace_install() replaces each function in fs_ops with a wrapper
+ * that times the call and counts the block I/O the calling thread
+ * did meanwhile (block_thread_stats, kept by misc.c), so everything
+ * that calls through fs_ops - FUSE, the benchmarks, the tests - is
+ * traced without changes to homework.c.
+ *
+ * Latencies go in log-linear histograms, as in HdrHistogram: 16
+ * buckets for each power of two of nanoseconds, so a percentile is
+ * within about 6% of the true value and recording one is a couple of
+ * instructions and an atomic increment.
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fuse.h>
+
+#include "fs5600.h"
+
+extern struct fuse_operations fs_ops;
+extern __thread struct block_stats block_thread_stats;
+
+#define HIST_SUB 16                     /* buckets per power of two */
+#define HIST_BUCKETS (61 * HIST_SUB)
+
+static int hist_index(uint64_t ns)
+{
+    if (ns < HIST_SUB) {
+        return ns;
+    }
+    int e = 63 - __builtin_clzll(ns);   /* 4 or more */
+    return (e - 3) * HIST_SUB + ((ns >> (e - 4)) & (HIST_SUB - 1));
+}
+
+/* the smallest latency that goes in bucket i
+ */
+static uint64_t hist_value(int i)
+{
+    if (i < HIST_SUB) {
+        return i;
+    }
+    int e = i / HIST_SUB + 3;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - 4);
+}
+
+enum {
+    T_GETATTR, T_FGETATTR, T_READDIR, T_OPEN, T_OPENDIR, T_READ, T_WRITE,
+    T_CREATE, T_MKDIR, T_UNLINK, T_RMDIR, T_RENAME, T_CHMOD, T_UTIME,
+    T_TRUNCATE, T_FTRUNCATE, T_STATFS, T_FLUSH, T_FSYNC, T_FSYNCDIR,
+    T_RELEASE, T_RELEASEDIR, T_NOPS
+};
+
+static const char *op_names[T_NOPS] = {
+    "getattr", "fgetattr", "readdir", "open", "opendir", "read", "write",
+    "create", "mkdir", "unlink", "rmdir", "rename", "chmod", "utime",
+    "truncate", "ftruncate", "statfs", "flush", "fsync", "fsyncdir",
+    "release", "releasedir"
+};
+
+/* updated by every thread without a lock, so all atomic
+ */
+static struct op_trace {
+    unsigned long calls, errors;
+    unsigned long reads, writes, dev_reads, dev_writes;
+    uint64_t total_ns, max_ns;
+    unsigned long hist[HIST_BUCKETS];
+} ops[T_NOPS];
+
+static struct fuse_operations orig_ops;
+static int installed;
+static char *dump_file;
+
+struct span {
+    struct timespec t0;
+    struct block_stats io;
+};
+
+static void span_start(struct span *s)
+{
+    s->io = block_thread_stats;
+    clock_gettime(CLOCK_MONOTONIC, &s->t0);
+}
+
+static int span_end(struct span *s, int op, int rv)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t ns = (t1.tv_sec - s->t0.tv_sec) * 1000000000ULL + t1.tv_nsec - s->t0.tv_nsec;
+    struct op_trace *t = &ops[op];
+    struct block_stats *io = &block_thread_stats;
+
+    __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+    if (rv < 0) {
+        __atomic_fetch_add(&t->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&t->reads, io->reads - s->io.reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->writes, io->writes - s->io.writes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->dev_reads, io->dev_reads - s->io.dev_reads, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->dev_writes, io->dev_writes - s->io.dev_writes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->hist[hist_index(ns)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&t->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&t->max_ns, &max, ns, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return rv;
+}
+
+#define TRACED(op, call) do {                   \
+        struct span s;                          \
+        span_start(&s);                         \
+        return span_end(&s, op, call);          \
+    } while (0)
+
+static int t_getattr(const char *path, struct stat *sb)
+{
+    TRACED(T_GETATTR, orig_ops.getattr(path, sb));
+}
+
+static int t_fgetattr(const char *path, struct stat *sb, struct fuse_file_info *fi)
+{
+    TRACED(T_FGETATTR, orig_ops.fgetattr(path, sb, fi));
+}
+
+static int t_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi)
+{
+    TRACED(T_READDIR, orig_ops.readdir(path, ptr, filler, offset, fi));
+}
+
+static int t_open(const char *path, struct fuse_file_info *fi)
+{
+    TRACED(T_OPEN, orig_ops.open(path, fi));
+}
+
+static int t_opendir(const char *path, struct fuse_file_info *fi)
+{
+    TRACED(T_OPENDIR, orig_ops.opendir(path, fi));
+}
+
+static int t_read(const char *path, char *buf, size_t len, off_t offset,
+                  struct fuse_file_info *fi)
+{
+    TRACED(T_READ, orig_ops.read(path, buf, len, offset, fi));
+}
+
+static int t_write(const char *path, const char *buf, size_t len, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    TRACED(T_WRITE, orig_ops.write(path, buf, len, offset, fi));
+}
+
+static int t_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    TRACED(T_CREATE, orig_ops.create(path, mode, fi));
+}
+
+static int t_mkdir(const char *path, mode_t mode)
+{
+    TRACED(T_MKDIR, orig_ops.mkdir(path, mode));
+}
+
+static int t_unlink(const char *path)
+{
+    TRACED(T_UNLINK, orig_ops.unlink(path));
+}
+
+static int t_rmdir(const char *path)
+{
+    TRACED(T_RMDIR, orig_ops.rmdir(path));
+}
+
+static int t_rename(const char *src, const char *dst)
+{
+    TRACED(T_RENAME, orig_ops.rename(src, dst));
+}
+
+static int t_chmod(const char *path, mode_t mode)
+{
+    TRACED(T_CHMOD, orig_ops.chmod(path, mode));
+}
+
+static int t_utime(const char *path, struct utimbuf *ut)
+{
+    TRACED(T_UTIME, orig_ops.utime(path, ut));
+}
+
+static int t_truncate(const char *path, off_t len)
+{
+    TRACED(T_TRUNCATE, orig_ops.truncate(path, len));
+}
+
+static int t_ftruncate(const char *path, off_t len, struct fuse_file_info *fi)
+{
+    TRACED(T_FTRUNCATE, orig_ops.ftruncate(path, len, fi));
+}
+
+static int t_statfs(const char *path, struct statvfs *st)
+{
+    TRACED(T_STATFS, orig_ops.statfs(path, st));
+}
+
+static int t_flush(const char *path, struct fuse_file_info *fi)
+{
+    TRACED(T_FLUSH, orig_ops.flush(path, fi));
+}
+
+static int t_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    TRACED(T_FSYNC, orig_ops.fsync(path, datasync, fi));
+}
+
+static int t_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    TRACED(T_FSYNCDIR, orig_ops.fsyncdir(path, datasync, fi));
+}
+
+static int t_release(const char *path, struct fuse_file_info *fi)
+{
+    TRACED(T_RELEASE, orig_ops.release(path, fi));
+}
+
+static int t_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    TRACED(T_RELEASEDIR, orig_ops.releasedir(path, fi));
+}
+
+/* latency at or below which fraction 'p' of the calls finished
+ */
+static uint64_t percentile(struct op_trace *t, double p)
+{
+    unsigned long want = p * t->calls, n = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        n += t->hist[i];
+        if (n > want) {
+            return hist_value(i);
+        }
+    }
+    return t->max_ns;
+}
+
+static void get_stats(struct op_trace *t, struct trace_stats *st)
+{
+    st->calls = t->calls;
+    st->errors = t->errors;
+    st->reads = t->reads;
+    st->writes = t->writes;
+    st->dev_reads = t->dev_reads;
+    st->dev_writes = t->dev_writes;
+    st->total_ns = t->total_ns;
+    st->p50_ns = percentile(t, 0.5);
+    st->p99_ns = percentile(t, 0.99);
+    st->p999_ns = percentile(t, 0.999);
+    st->max_ns = t->max_ns;
+}
+
+int trace_get_stats(const char *name, struct trace_stats *st)
+{
+    for (int i = 0; i < T_NOPS; i++) {
+        if (strcmp(name, op_names[i]) == 0) {
+            get_stats(&ops[i], st);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* the same for all operations together
+ */
+void trace_get_total(struct trace_stats *st)
+{
+    static struct op_trace all;
+    memset(&all, 0, sizeof(all));
+    for (int i = 0; i < T_NOPS; i++) {
+        struct op_trace *t = &ops[i];
+        all.calls += t->calls;
+        all.errors += t->errors;
+        all.reads += t->reads;
+        all.writes += t->writes;
+        all.dev_reads += t->dev_reads;
+        all.dev_writes += t->dev_writes;
+        all.total_ns += t->total_ns;
+        all.max_ns = (t->max_ns > all.max_ns) ? t->max_ns : all.max_ns;
+        for (int j = 0; j < HIST_BUCKETS; j++) {
+            all.hist[j] += t->hist[j];
+        }
+    }
+    get_stats(&all, st);
+}
+
+void trace_reset(void)
+{
+    memset(ops, 0, sizeof(ops));
+}
+
+/* one line per operation that has been called: count, errors, mean
+ * and percentile latencies in microseconds, block_read/block_write
+ * calls and device reads/writes per call
+ */
+void trace_dump(FILE *fp)
+{
+    fprintf(fp, "%-11s %9s %6s %9s %9s %9s %9s %9s %8s %8s %8s %8s\n",
+            "op", "calls", "errors", "mean-us", "p50-us", "p99-us", "p999-us",
+            "max-us", "reads", "writes", "dev-rd", "dev-wr");
+    for (int i = 0; i < T_NOPS; i++) {
+        struct trace_stats st;
+        trace_get_stats(op_names[i], &st);
+        if (st.calls == 0) {
+            continue;
+        }
+        double n = st.calls;
+        fprintf(fp, "%-11s %9lu %6lu %9.2f %9.2f %9.2f %9.2f %9.2f %8.2f %8.2f %8.2f %8.2f\n",
+                op_names[i], st.calls, st.errors, st.total_ns / n / 1e3,
+                st.p50_ns / 1e3, st.p99_ns / 1e3, st.p999_ns / 1e3, st.max_ns / 1e3,
+                st.reads / n, st.writes / n, st.dev_reads / n, st.dev_writes / n);
+    }
+    fflush(fp);
+}
+
+static void dump_to_file(void)
+{
+    FILE *fp = fopen(dump_file, "a");
+    if (fp != NULL) {
+        time_t now = time(NULL);
+        fprintf(fp, "--- %s", ctime(&now));
+        trace_dump(fp);
+        fclose(fp);
+    }
+}
+
+/* SIGUSR1 is blocked in every thread but this one, which waits for
+ * it and writes a dump; a signal handler couldn't use stdio
+ */
+static void *signal_thread(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    for (;;) {
+        int sig;
+        if (sigwait(&set, &sig) == 0) {
+            dump_to_file();
+        }
+    }
+    return NULL;
+}
+
+/* the signal thread is started from init, which FUSE calls after it
+ * has forked into the background: threads don't survive the fork
+ */
+static void *t_init(struct fuse_conn_info *conn)
+{
+    void *rv = orig_ops.init(conn);
+    static int started;
+    if (dump_file != NULL && !started) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, signal_thread, NULL);
+        pthread_detach(tid);
+        started = 1;
+    }
+    return rv;
+}
+
+static void t_destroy(void *private_data)
+{
+    orig_ops.destroy(private_data);
+    if (dump_file != NULL) {
+        dump_to_file();
+    }
+}
+
+/* start tracing the calls made through fs_ops. If 'file' isn't NULL,
+ * SIGUSR1 and unmount append a dump to it. Call before any threads
+ * are started, so they all inherit SIGUSR1 blocked.
+ */
+void trace_install(char *file)
+{
+    dump_file = file;
+    if (file != NULL) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+    if (installed) {
+        return;
+    }
+    installed = 1;
+    orig_ops = fs_ops;
+    fs_ops.init = t_init;
+    fs_ops.destroy = t_destroy;
+    fs_ops.getattr = t_getattr;
+    fs_ops.fgetattr = t_fgetattr;
+    fs_ops.readdir = t_readdir;
+    fs_ops.open = t_open;
+    fs_ops.opendir = t_opendir;
+    fs_ops.read = t_read;
+    fs_ops.write = t_write;
+    fs_ops.create = t_create;
+    fs_ops.mkdir = t_mkdir;
+    fs_ops.unlink = t_unlink;
+    fs_ops.rmdir = t_rmdir;
+    fs_ops.rename = t_rename;
+    fs_ops.chmod = t_chmod;
+    fs_ops.utime = t_utime;
+    fs_ops.truncate = t_truncate;
+    fs_ops.ftruncate = t_ftruncate;
+    fs_ops.statfs = t_statfs;
+    fs_ops.flush = t_flush;
+    fs_ops.fsync = t_fsync;
+    fs_ops.fsyncdir = t_fsyncdir;
+    fs_ops.release = t_release;
+    fs_ops.releasedir = t_releasedir;
+}
@@ -199,6 +199,7 @@ END_TEST
  */
 START_TEST(read_sbr_test) {
     system("python gen-disk.py -q disk1.in test.img");
+    fs_ops.init(NULL);
     int i = 0;
     for (i = 0; cksum_table[i].path != NULL; i++) {
         char *buf = malloc(sizeof(char) * cksum_table[i].len);
@@ -338,6 +339,7 @@ END_TEST
  */
 START_TEST(fsrename_dir_test) {
     system("python gen-disk.py -q disk1.in test.img");
+    fs_ops.init(NULL);
     int cksum_index = 6;
     cksum cksum_entry = cksum_table[cksum_index];
     const char *src_dir = "/dir3/subdir";
@@ -361,6 +363,7 @@ END_TEST
 START_TEST(fsrename_error_test) {
 
     system("python gen-disk.py -q disk1.in test.img");
+    fs_ops.init(NULL);
     const char *src_dir = "/dir3/invalid";
     const char *des_dir = "/dir3/renameddir";
     int status;
@@ -391,9 +394,8 @@ void test_setup(Suite *s, const char *str, const TTest *f) {
 int main(int argc, char **argv)
 {
     block_init("test.img");
-    fs_ops.init(NULL);
-
     system("python gen-disk.py -q disk1.in test.img");
+    fs_ops.init(NULL);
 
     Suite *s = suite_create("unittest1");
 
@@ -10,13 +10,49 @@
 #include <check.h>
 #include <errno.h>
 #include <fuse.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
 
+#include "fs5600.h"
+
 extern struct fuse_operations fs_ops;
 extern void block_init(char *file);
+extern int block_read(void *buf, int lba, int nblks);
+extern void block_get_stats(struct block_stats *st);
+extern void block_reset_stats(void);
+extern int block_mmap_enabled;
+extern int block_cache_capacity;
+extern int block_uring_enabled;
+extern int block_flush(int sync);
+extern int block_flush_interval;
+extern void block_readahead_drain(void);
+extern int readahead_max;
+extern int conn_max_write;
+extern int set_durability(const char *name);
+extern int fs_mount(void);
+extern void trace_install(char *file);
+extern void trace_reset(void);
+extern void trace_dump(FILE *fp);
+extern int trace_get_stats(const char *name, struct trace_stats *st);
+extern int fs_getattr_inum(int inum, struct stat *sb);
+extern int fs_lookup_at(int dir, const char *name, struct stat *sb);
+extern int fs_open_inum(int inum, struct fuse_file_info *fi, int dir);
+extern int fs_create_at(int dir, const char *name, mode_t mode,
+                        struct fuse_file_info *fi);
+extern int fs_mkdir_at(int dir, const char *name, mode_t mode);
+extern int fs_unlink_at(int dir, const char *name);
+extern int fs_rmdir_at(int dir, const char *name);
+extern int fs_rename_at(int dir, const char *name, int newdir,
+                        const char *newname);
+extern int read_inode(int inum, struct fs_inode *inode);
+extern int alloc_extent(int goal, int want, int *got);
+extern void mark_block_free(int blk);
+extern void unmark_block_used(int blk);
+extern void flush_bitmap(void);
+extern size_t fs_readdir_reply_len(const size_t *ends, int n, off_t off, size_t size);
 
 typedef struct {
     char *path;
@@ -92,6 +128,11 @@ int test_filler(void *ptr, const char *name, const struct stat *st, off_t off) {
     }
     return 1;
 }
+
+int count_filler(void *ptr, const char *name, const struct stat *st, off_t off) {
+    (*(int *)ptr)++;
+    return 0;
+}
 
 
 /**
@@ -490,6 +531,780 @@ START_TEST(fs_truncate_test) {
 END_TEST
 
 
+/**
+* @brief testing lookups stay correct across namespace changes
+*/
+START_TEST(lookup_after_change_test) {
+    struct stat sb;
+    char *path = "/dir3/subdir/file.4k-";
+    ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+    ck_assert_int_eq(4095, sb.st_size);
+
+    ck_assert_int_eq(0, fs_ops.unlink(path));
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr(path, &sb));
+    ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+    ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+    ck_assert_int_eq(0, sb.st_size);
+
+    ck_assert_int_eq(0, fs_ops.rename(path, "/dir3/subdir/moved"));
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr(path, &sb));
+    ck_assert_int_eq(0, fs_ops.getattr("/dir3/subdir/moved", &sb));
+
+    ck_assert_int_eq(0, fs_ops.mkdir("/dir2/tmpdir", 0777));
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr("/dir2/tmpdir/x", &sb));
+    ck_assert_int_eq(0, fs_ops.rmdir("/dir2/tmpdir"));
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr("/dir2/tmpdir/x", &sb));
+}
+END_TEST
+
+
+/**
+* @brief testing multi-block writes with unaligned edges, and that a
+* write the disk can't hold changes nothing
+*/
+START_TEST(fswrite_extent_test) {
+    char *path = "/big";
+    int len = FS_BLOCK_SIZE * 20;
+    char *buf = malloc(len);
+    new_buf(buf, len);
+    ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+    ck_assert_int_eq(len - 100, fs_ops.write(path, buf, len - 100, 0, NULL));
+
+    /* partial head, 10 whole blocks, partial tail, past the old end */
+    int offset = FS_BLOCK_SIZE * 5 + 123;
+    new_buf(buf + offset, len - offset);
+    ck_assert_int_eq(len - offset, fs_ops.write(path, buf + offset, len - offset, offset, NULL));
+    verify_write(path, len, 0, crc32(0, (unsigned char *)buf, len));
+
+    struct statvfs st;
+    fs_ops.statfs("nothing", &st);
+    int num_free = st.f_bfree;
+    int too_big = (num_free + 1) * FS_BLOCK_SIZE;
+    char *big = calloc(1, too_big);
+    ck_assert_int_eq(-ENOSPC, fs_ops.write(path, big, too_big, len, NULL));
+    fs_ops.statfs("nothing", &st);
+    ck_assert_int_eq(num_free, st.f_bfree);
+    verify_write(path, len, 0, crc32(0, (unsigned char *)buf, len));
+    free(big);
+    free(buf);
+}
+END_TEST
+
+
+/**
+* @brief testing that the allocator fills the whole disk, keeps the
+* free count right, and reuses blocks once they are freed
+*/
+START_TEST(fill_disk_test) {
+    struct statvfs st;
+    fs_ops.statfs("nothing", &st);
+    int num_free = st.f_bfree;
+    int chunk = FS_BLOCK_SIZE * 7;
+    char *buf = calloc(1, chunk);
+
+    for (int pass = 0; pass < 3; pass++) {
+        ck_assert_int_eq(0, fs_ops.create("/fill", 0100666, NULL));
+        int offset = 0;
+        while (fs_ops.write("/fill", buf, chunk, offset, NULL) == chunk) {
+            offset += chunk;
+        }
+        fs_ops.statfs("nothing", &st);
+        ck_assert_int_lt(st.f_bfree, 7);
+        ck_assert_int_eq(num_free - 1 - offset / FS_BLOCK_SIZE, st.f_bfree);
+
+        ck_assert_int_eq(0, fs_ops.unlink("/fill"));
+        fs_ops.statfs("nothing", &st);
+        ck_assert_int_eq(num_free, st.f_bfree);
+    }
+    free(buf);
+}
+END_TEST
+
+/**
+* @brief a file big enough to need the single- and double-indirect blocks,
+* on the larger bench image. A bench image with small inodes reports
+* f_files, and its inodes don't take blocks.
+*/
+START_TEST(fswrite_indirect_test) {
+    system("python gen-disk.py -q bench.in test.img");
+    fs_ops.init(NULL);
+
+    struct statvfs st;
+    fs_ops.statfs("nothing", &st);
+    int num_free = st.f_bfree;
+    int inode_blks = st.f_files ? 0 : 1;
+    /* past the double-indirect threshold with 4K (1017 direct
+     * pointers) or 128-byte (25) inodes, one second-level block either way
+     */
+    int nblks = 2060, chunk = 17 * FS_BLOCK_SIZE;
+    int len = nblks * FS_BLOCK_SIZE;
+    char *buf = malloc(len), *rbuf = malloc(len);
+    for (int i = 0; i < len; i++) {
+        buf[i] = 'A' + (i * 7 + i / FS_BLOCK_SIZE) % 53;
+    }
+
+    ck_assert_int_eq(0, fs_ops.create("/big", 0100666, NULL));
+    for (int offset = 0; offset < len; offset += chunk) {
+        int n = (len - offset < chunk) ? len - offset : chunk;
+        ck_assert_int_eq(n, fs_ops.write("/big", buf + offset, n, offset, NULL));
+    }
+    fs_ops.statfs("nothing", &st);
+    /* inode, data, indirect, double-indirect and one pointer block */
+    ck_assert_int_eq(num_free - inode_blks - nblks - 3, st.f_bfree);
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    struct stat sb;
+    ck_assert_int_eq(0, fs_ops.getattr("/big", &sb));
+    ck_assert_int_eq(len, sb.st_size);
+    ck_assert_int_eq(len, fs_ops.read("/big", rbuf, len, 0, NULL));
+    ck_assert_int_eq(crc32(0, (unsigned char *)buf, len),
+                     crc32(0, (unsigned char *)rbuf, len));
+    ck_assert_int_eq(100, fs_ops.read("/big", rbuf, 100, 2042 * FS_BLOCK_SIZE - 50, NULL));
+    ck_assert(memcmp(rbuf, buf + 2042 * FS_BLOCK_SIZE - 50, 100) == 0);
+
+    ck_assert_int_eq(0, fs_ops.truncate("/big", 0));
+    fs_ops.statfs("nothing", &st);
+    ck_assert_int_eq(num_free - inode_blks, st.f_bfree);
+    ck_assert_int_eq(0, fs_ops.unlink("/big"));
+    fs_ops.statfs("nothing", &st);
+    ck_assert_int_eq(num_free, st.f_bfree);
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+
+/**
+* @brief a directory that outgrows one block, on the bench image (which has
+* hashed directories)
+*/
+START_TEST(big_dir_test) {
+    system("python gen-disk.py -q bench.in test.img");
+    fs_ops.init(NULL);
+
+    struct statvfs st;
+    fs_ops.statfs("nothing", &st);
+    int num_free = st.f_bfree, num_ffree = st.f_ffree;
+    int inode_blks = st.f_files ? 0 : 1, n_direct = st.f_files ? 25 : 1017;
+    int nfiles = 3000;
+    char path[64], path2[64];
+    struct stat sb;
+
+    ck_assert_int_eq(0, fs_ops.mkdir("/big", 0777));
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, "/big/file-%d", i);
+        ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+    }
+    ck_assert_int_eq(-EEXIST, fs_ops.create("/big/file-17", 0100666, NULL));
+    ck_assert_int_eq(0, fs_ops.getattr("/big", &sb));
+    int dir_blocks = sb.st_size / FS_BLOCK_SIZE;
+    ck_assert_int_gt(dir_blocks, nfiles / 128);
+    ck_assert_int_eq(0, dir_blocks & (dir_blocks - 1));
+    fs_ops.statfs("nothing", &st);
+    int ptr_blks = dir_blocks > n_direct;
+    ck_assert_int_eq(num_free - (1 + nfiles) * inode_blks - dir_blocks - ptr_blks,
+                     st.f_bfree);
+    if (st.f_files) {
+        ck_assert_int_eq(num_ffree - 1 - nfiles, st.f_ffree);
+    }
+
+    /* rename moves entries between blocks */
+    for (int i = 0; i < nfiles; i += 10) {
+        sprintf(path, "/big/file-%d", i);
+        sprintf(path2, "/big/renamed-%d", i);
+        ck_assert_int_eq(0, fs_ops.rename(path, path2));
+    }
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    int count = 0;
+    ck_assert_int_eq(0, fs_ops.readdir("/big", &count, count_filler, 0, NULL));
+    ck_assert_int_eq(nfiles, count);
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, (i % 10) ? "/big/file-%d" : "/big/renamed-%d", i);
+        ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+        sprintf(path, (i % 10) ? "/big/renamed-%d" : "/big/file-%d", i);
+        ck_assert_int_eq(-ENOENT, fs_ops.getattr(path, &sb));
+    }
+
+    ck_assert_int_eq(-ENOTEMPTY, fs_ops.rmdir("/big"));
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(path, (i % 10) ? "/big/file-%d" : "/big/renamed-%d", i);
+        ck_assert_int_eq(0, fs_ops.unlink(path));
+    }
+    ck_assert_int_eq(0, fs_ops.rmdir("/big"));
+    fs_ops.statfs("nothing", &st);
+    ck_assert_int_eq(num_free, st.f_bfree);
+    ck_assert_int_eq(num_ffree, st.f_ffree);
+}
+END_TEST
+
+
+/**
+* @brief bench.in has the disk1.in tree in the small-inode format
+*/
+START_TEST(small_inode_test) {
+    system("python gen-disk.py -q bench.in test.img");
+    fs_ops.init(NULL);
+
+    struct stat sb;
+    for (int i = 0; inode_attrable[i].path != NULL; i++) {
+        ck_assert_int_eq(0, fs_ops.getattr(inode_attrable[i].path, &sb));
+        ck_assert_int_eq(inode_attrable[i].uid, sb.st_uid);
+        ck_assert_int_eq(inode_attrable[i].gid, sb.st_gid);
+        ck_assert_int_eq(inode_attrable[i].mode, sb.st_mode);
+        ck_assert_int_eq(inode_attrable[i].size, sb.st_size);
+        ck_assert_int_eq(inode_attrable[i].mtime, sb.st_mtime);
+    }
+
+    /* inodes sharing a table block keep their own attributes */
+    char path[64];
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "/f%d", i);
+        ck_assert_int_eq(0, fs_ops.create(path, 0100600 | i, NULL));
+        ck_assert_int_eq(i + 1, fs_ops.write(path, path, i + 1, 0, NULL));
+    }
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "/f%d", i);
+        ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+        ck_assert_int_eq(0100600 | i, sb.st_mode);
+        ck_assert_int_eq(i + 1, sb.st_size);
+    }
+}
+END_TEST
+
+/**
+* @brief big.in is a 160 MB disk with two bitmap blocks; a file bigger than
+* 128 MB has to use blocks from both
+*/
+START_TEST(big_disk_test) {
+    system("python gen-disk.py -q big.in test.img");
+    fs_ops.init(NULL);
+
+    struct statvfs st;
+    fs_ops.statfs("nothing", &st);
+    /* superblock, 2 bitmap blocks, inode map and 640 inode table blocks */
+    ck_assert_int_eq(40960 - 1 - 2 - 1 - 640, st.f_blocks);
+    int num_free = st.f_bfree;
+
+    int nblks = 36000, chunk = 256 * FS_BLOCK_SIZE;
+    char *buf = malloc(chunk), *rbuf = malloc(chunk);
+    ck_assert_int_eq(0, fs_ops.create("/huge", 0100666, NULL));
+    for (int k = 0; k * 256 < nblks; k++) {
+        int n = (nblks - k * 256 < 256) ? (nblks - k * 256) * FS_BLOCK_SIZE : chunk;
+        memset(buf, 'a' + k % 26, n);
+        sprintf(buf, "chunk %d", k);
+        ck_assert_int_eq(n, fs_ops.write("/huge", buf, n, (off_t)k * chunk, NULL));
+    }
+    fs_ops.statfs("nothing", &st);
+    /* data, indirect, double-indirect and 35 pointer blocks */
+    ck_assert_int_eq(num_free - nblks - 37, st.f_bfree);
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    fs_ops.statfs("nothing", &st);
+    ck_assert_int_eq(num_free - nblks - 37, st.f_bfree);
+    /* buf still holds the last chunk, which is past block 32768 */
+    int last = (nblks - 1) / 256, tail = (nblks - last * 256) * FS_BLOCK_SIZE;
+    ck_assert_int_eq(tail, fs_ops.read("/huge", rbuf, chunk, (off_t)last * chunk, NULL));
+    ck_assert(memcmp(rbuf, buf, tail) == 0);
+    ck_assert_int_eq(chunk, fs_ops.read("/huge", rbuf, chunk, 0, NULL));
+    ck_assert_int_eq(0, strcmp(rbuf, "chunk 0"));
+
+    ck_assert_int_eq(0, fs_ops.unlink("/huge"));
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    fs_ops.statfs("nothing", &st);
+    ck_assert_int_eq(num_free, st.f_bfree);
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+/**
+* @brief the same reads and writes with the image mapped into memory: no
+* read requests go to the image, and the data is in the file once the
+* file system is unmounted
+*/
+START_TEST(mmap_test) {
+    block_mmap_enabled = 1;
+    block_init("test.img");
+    fs_ops.init(NULL);
+    block_reset_stats();
+
+    struct stat sb;
+    for (int i = 0; inode_attrable[i].path != NULL; i++) {
+        ck_assert_int_eq(0, fs_ops.getattr(inode_attrable[i].path, &sb));
+        ck_assert_int_eq(inode_attrable[i].size, sb.st_size);
+    }
+    int len = 20000;
+    char *buf = malloc(len), *rbuf = malloc(len);
+    for (int i = 0; i < len; i++) {
+        buf[i] = 'a' + i % 23;
+    }
+    ck_assert_int_eq(0, fs_ops.create("/mapped", 0100666, NULL));
+    ck_assert_int_eq(len, fs_ops.write("/mapped", buf, len, 0, NULL));
+    ck_assert_int_eq(len, fs_ops.read("/mapped", rbuf, len, 0, NULL));
+    ck_assert(memcmp(buf, rbuf, len) == 0);
+
+    struct block_stats bs;
+    block_get_stats(&bs);
+    ck_assert_int_eq(0, bs.dev_reads);
+    fs_ops.destroy(NULL);
+
+    block_mmap_enabled = 0;
+    block_init("test.img");
+    fs_ops.init(NULL);
+    memset(rbuf, 0, len);
+    ck_assert_int_eq(len, fs_ops.read("/mapped", rbuf, len, 0, NULL));
+    ck_assert(memcmp(buf, rbuf, len) == 0);
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+/**
+* @brief with io_uring, a read of a fragmented file is one batch of requests,
+* and so is writing back the blocks of another one. Where io_uring
+* isn't available it turns itself off and the same calls work
+* synchronously.
+*/
+START_TEST(uring_test) {
+    block_uring_enabled = 1;
+    fs_ops.init(NULL);
+    block_reset_stats();
+
+    /* blocks 233,116,311,109 */
+    char buf[12289], wbuf[4 * FS_BLOCK_SIZE];
+    ck_assert_int_eq(12289, fs_ops.read("/dir-with-long-name/file.12k+", buf, sizeof(buf), 0, NULL));
+    ck_assert_int_eq(2781093465u, crc32(0, (unsigned char *)buf, sizeof(buf)));
+    ck_assert_int_eq(100, fs_ops.read("/dir-with-long-name/file.12k+", buf, 100, 4090, NULL));
+
+    /* interleave two files so neither is contiguous */
+    memset(wbuf, 'x', sizeof(wbuf));
+    ck_assert_int_eq(0, fs_ops.create("/u1", 0100666, NULL));
+    ck_assert_int_eq(0, fs_ops.create("/u2", 0100666, NULL));
+    for (int i = 0; i < 4; i++) {
+        sprintf(wbuf + i * FS_BLOCK_SIZE, "u1 block %d", i);
+        ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/u1", wbuf + i * FS_BLOCK_SIZE,
+                                                     FS_BLOCK_SIZE, i * FS_BLOCK_SIZE, NULL));
+        ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/u2", wbuf, FS_BLOCK_SIZE,
+                                                     i * FS_BLOCK_SIZE, NULL));
+    }
+    ck_assert_int_eq(0, block_flush(1));
+    fs_ops.init(NULL);
+    char rbuf[sizeof(wbuf)];
+    ck_assert_int_eq(sizeof(rbuf), fs_ops.read("/u1", rbuf, sizeof(rbuf), 0, NULL));
+    ck_assert(memcmp(wbuf, rbuf, sizeof(rbuf)) == 0);
+
+    struct block_stats bs;
+    block_get_stats(&bs);
+    ck_assert(!block_uring_enabled || bs.dev_batches >= 3);
+    block_uring_enabled = 0;
+}
+END_TEST
+
+/**
+* @brief read a 64-block file a block at a time, letting each read-ahead
+* finish before the next read so the counts don't depend on timing
+*/
+START_TEST(readahead_test) {
+    char wbuf[FS_BLOCK_SIZE], rbuf[FS_BLOCK_SIZE];
+    ck_assert_int_eq(0, fs_ops.create("/ra", 0100666, NULL));
+    for (int i = 0; i < 64; i++) {
+        memset(wbuf, 'a' + i % 26, sizeof(wbuf));
+        ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/ra", wbuf, FS_BLOCK_SIZE,
+                                                     i * FS_BLOCK_SIZE, NULL));
+    }
+    ck_assert_int_eq(0, block_flush(1));
+
+    struct block_stats bs;
+    for (int pass = 0; pass < 2; pass++) {
+        readahead_max = pass ? 0 : 256;
+        fs_ops.init(NULL);
+        block_reset_stats();
+        for (int i = 0; i < 64; i++) {
+            ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.read("/ra", rbuf, FS_BLOCK_SIZE,
+                                                        i * FS_BLOCK_SIZE, NULL));
+            ck_assert(rbuf[0] == 'a' + i % 26 && rbuf[FS_BLOCK_SIZE - 1] == rbuf[0]);
+            block_readahead_drain();
+        }
+        block_get_stats(&bs);
+        if (pass == 0) {
+            ck_assert_int_eq(63, bs.ra_blocks);
+            ck_assert_int_eq(63, bs.ra_hits);
+        } else {
+            ck_assert_int_eq(0, bs.ra_blocks);
+        }
+    }
+    readahead_max = 256;
+
+    /* random reads don't start it */
+    fs_ops.init(NULL);
+    block_reset_stats();
+    int order[] = {40, 3, 17, 60, 9, 33};
+    for (int i = 0; i < 6; i++) {
+        ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.read("/ra", rbuf, FS_BLOCK_SIZE,
+                                                    order[i] * FS_BLOCK_SIZE, NULL));
+        ck_assert(rbuf[0] == 'a' + order[i] % 26);
+    }
+    block_readahead_drain();
+    block_get_stats(&bs);
+    ck_assert_int_eq(0, bs.ra_blocks);
+}
+END_TEST
+
+/**
+* @brief calls on an open file use the handle, not the path: they still work
+* after a rename, see changes made by path, and fail once the file is
+* unlinked
+*/
+START_TEST(open_handle_test) {
+    struct fuse_file_info fi, fi2, dfi;
+    struct stat sb;
+    char buf[100];
+    memset(&fi, 0, sizeof(fi));
+    memset(&fi2, 0, sizeof(fi2));
+    memset(&dfi, 0, sizeof(dfi));
+
+    ck_assert_int_eq(-ENOENT, fs_ops.open("/nothere", &fi));
+    ck_assert_int_eq(-EISDIR, fs_ops.open("/dir2", &fi));
+    ck_assert_int_eq(-ENOTDIR, fs_ops.opendir("/file.1k", &dfi));
+
+    ck_assert_int_eq(0, fs_ops.create("/h", 0100666, &fi));
+    ck_assert(fi.fh != 0);
+    ck_assert_int_eq(5, fs_ops.write("/h", "hello", 5, 0, &fi));
+    ck_assert_int_eq(0, fs_ops.open("/h", &fi2));
+    ck_assert(fi2.fh == fi.fh);
+
+    ck_assert_int_eq(0, fs_ops.rename("/h", "/h2"));
+    ck_assert_int_eq(6, fs_ops.write("/h", " world", 6, 5, &fi2));
+    ck_assert_int_eq(11, fs_ops.read("/h", buf, sizeof(buf), 0, &fi));
+    ck_assert(memcmp(buf, "hello world", 11) == 0);
+    ck_assert_int_eq(0, fs_ops.fgetattr("/h", &sb, &fi));
+    ck_assert_int_eq(11, sb.st_size);
+
+    ck_assert_int_eq(0, fs_ops.chmod("/h2", 0100600));
+    ck_assert_int_eq(0, fs_ops.fgetattr("/h", &sb, &fi2));
+    ck_assert_int_eq(0100600, sb.st_mode);
+    ck_assert_int_eq(0, fs_ops.ftruncate("/h", 0, &fi));
+    ck_assert_int_eq(0, fs_ops.getattr("/h2", &sb));
+    ck_assert_int_eq(0, sb.st_size);
+    ck_assert_int_eq(0, fs_ops.flush("/h", &fi));
+    ck_assert_int_eq(0, fs_ops.release("/h", &fi));
+
+    ck_assert_int_eq(0, fs_ops.opendir("/dir2", &dfi));
+    int n = 0;
+    ck_assert_int_eq(0, fs_ops.readdir("/nothere", &n, count_filler, 0, &dfi));
+    ck_assert_int_eq(2, n);
+    ck_assert_int_eq(0, fs_ops.releasedir("/dir2", &dfi));
+
+    ck_assert_int_eq(0, fs_ops.unlink("/h2"));
+    ck_assert_int_eq(-ENOENT, fs_ops.read("/h2", buf, sizeof(buf), 0, &fi2));
+    ck_assert_int_eq(-ENOENT, fs_ops.flush("/h2", &fi2));
+    ck_assert_int_eq(0, fs_ops.release("/h2", &fi2));
+}
+END_TEST
+
+int ino_filler(void *ptr, const char *name, const struct stat *st, off_t off) {
+    if (strcmp(name, "file.4k+") == 0) {
+        *(int *)ptr = st->st_ino;
+    }
+    return 0;
+}
+
+/**
+* @brief the inode-number interface used by hw3ll: lookups by (directory,
+* name), and the same results and errors as the path operations
+*/
+START_TEST(inum_api_test) {
+    struct fuse_file_info fi;
+    struct stat sb;
+    memset(&fi, 0, sizeof(fi));
+
+    int dir2 = fs_lookup_at(2, "dir2", &sb);
+    ck_assert_int_eq(213, dir2);
+    ck_assert(S_ISDIR(sb.st_mode));
+    ck_assert_int_eq(139, fs_lookup_at(dir2, "file.4k+", &sb));
+    ck_assert_int_eq(4098, sb.st_size);
+    ck_assert_int_eq(-ENOENT, fs_lookup_at(dir2, "nothere", &sb));
+    ck_assert_int_eq(-ENOTDIR, fs_lookup_at(139, "x", &sb));
+
+    int ino = 0;
+    ck_assert_int_eq(0, fs_open_inum(dir2, &fi, 1));
+    ck_assert_int_eq(0, fs_ops.readdir(NULL, &ino, ino_filler, 0, &fi));
+    ck_assert_int_eq(139, ino);
+    ck_assert_int_eq(0, fs_ops.releasedir(NULL, &fi));
+
+    int f = fs_create_at(dir2, "new", 0100644, &fi);
+    ck_assert(f > 0);
+    ck_assert_int_eq(-EEXIST, fs_create_at(dir2, "new", 0100644, NULL));
+    ck_assert_int_eq(3, fs_ops.write(NULL, "abc", 3, 0, &fi));
+    ck_assert_int_eq(0, fs_ops.release(NULL, &fi));
+    ck_assert_int_eq(0, fs_ops.getattr("/dir2/new", &sb));
+    ck_assert_int_eq(3, sb.st_size);
+
+    int d = fs_mkdir_at(dir2, "sub", 0777);
+    ck_assert(d > 0);
+    ck_assert_int_eq(0, fs_getattr_inum(d, &sb));
+    ck_assert(S_ISDIR(sb.st_mode));
+    ck_assert_int_eq(-ENOTDIR, fs_mkdir_at(f, "sub", 0777));
+
+    ck_assert_int_eq(-EINVAL, fs_rename_at(dir2, "new", d, "new"));
+    ck_assert_int_eq(0, fs_rename_at(dir2, "new", dir2, "new2"));
+    ck_assert_int_eq(f, fs_lookup_at(dir2, "new2", &sb));
+
+    ck_assert_int_eq(-EISDIR, fs_unlink_at(dir2, "sub"));
+    ck_assert_int_eq(-ENOTDIR, fs_rmdir_at(dir2, "new2"));
+    ck_assert_int_eq(0, fs_unlink_at(dir2, "new2"));
+    ck_assert_int_eq(0, fs_rmdir_at(dir2, "sub"));
+    ck_assert_int_eq(-ENOENT, fs_lookup_at(dir2, "sub", &sb));
+}
+END_TEST
+
+/**
+* @brief init asks for big writes and splice, but only those the kernel has
+*/
+START_TEST(conn_setup_test) {
+    struct fuse_conn_info conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.capable = FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ;
+    conn.want = FUSE_CAP_ASYNC_READ;
+    conn.max_write = 4096;
+    fs_ops.init(&conn);
+    ck_assert_int_eq(FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ,
+                     conn.want);
+    ck_assert_int_eq(conn_max_write, conn.max_write);
+
+    struct stat sb;
+    ck_assert_int_eq(0, fs_ops.getattr("/file.1k", &sb));
+}
+END_TEST
+
+/**
+* @brief listing a directory reads its entries' inodes in a batch, and the
+* getattr calls of "ls -l" that follow find them in the cache
+*/
+START_TEST(readdir_prefetch_test) {
+    char path[32];
+    struct stat sb;
+    struct block_stats bs;
+    ck_assert_int_eq(0, fs_ops.mkdir("/ls", 0777));
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "/ls/f%d", i);
+        ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+        ck_assert_int_eq(3, fs_ops.write(path, "abc", 3, 0, NULL));
+    }
+    ck_assert_int_eq(0, block_flush(1));
+    fs_ops.init(NULL);
+    block_reset_stats();
+
+    int n = 0;
+    ck_assert_int_eq(0, fs_ops.readdir("/ls", &n, count_filler, 0, NULL));
+    ck_assert_int_eq(40, n);
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "/ls/f%d", i);
+        ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+        ck_assert_int_eq(3, sb.st_size);
+    }
+    block_get_stats(&bs);
+    ck_assert(bs.dev_reads < 10);
+}
+END_TEST
+
+
+/**
+* @brief on a journal image a commit makes everything before it survive a
+* crash (here: the cache dropped without writing back), nothing after
+* it is half there, and a torn record isn't replayed
+*/
+START_TEST(journal_test) {
+    system("python gen-disk.py -q journal.in test.img");
+    fs_ops.init(NULL);
+    char path[32], buf[8];
+    struct stat sb;
+    struct statvfs before, after;
+    struct block_stats bs;
+    ck_assert_int_eq(0, fs_ops.statfs("/", &before));
+
+    block_reset_stats();
+    ck_assert_int_eq(0, fs_ops.mkdir("/j", 0777));
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/j/f%d", i);
+        ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+        ck_assert_int_eq(3, fs_ops.write(path, "abc", 3, 0, NULL));
+    }
+    ck_assert_int_eq(0, block_flush(1));
+    block_get_stats(&bs);
+    ck_assert(bs.commits >= 1 && bs.commits <= 4);
+    ck_assert(bs.logged > 0 && bs.logged < 100);
+
+    ck_assert_int_eq(0, fs_ops.create("/j/lost", 0100666, NULL));
+    ck_assert_int_eq(0, fs_ops.unlink("/j/f0"));
+    fs_ops.init(NULL);
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr("/j/lost", &sb));
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/j/f%d", i);
+        ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+        ck_assert_int_eq(3, sb.st_size);
+    }
+    ck_assert_int_eq(3, fs_ops.read("/j/f50", buf, 8, 0, NULL));
+    ck_assert(memcmp(buf, "abc", 3) == 0);
+
+    /* unmount checkpoints, so the next record goes at log block 1:
+     * flip a byte in it */
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.create("/j/torn", 0100666, NULL));
+    ck_assert_int_eq(0, block_flush(1));
+    struct fs_super super;
+    FILE *fp = fopen("test.img", "r+");
+    ck_assert(fread(&super, sizeof(super), 1, fp) == 1);
+    fseek(fp, (long)(super.journal + 2) * FS_BLOCK_SIZE + 100, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, -1, SEEK_CUR);
+    fputc(c ^ 1, fp);
+    fclose(fp);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr("/j/torn", &sb));
+
+    /* and nothing leaked */
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/j/f%d", i);
+        ck_assert_int_eq(0, fs_ops.unlink(path));
+    }
+    ck_assert_int_eq(0, fs_ops.rmdir("/j"));
+    ck_assert_int_eq(0, fs_ops.statfs("/", &after));
+    ck_assert_int_eq(before.f_bfree, after.f_bfree);
+    ck_assert_int_eq(before.f_ffree, after.f_ffree);
+    fs_ops.destroy(NULL);
+}
+END_TEST
+
+/**
+* @brief with a cache so small that one operation's metadata fills a shard
+* (and commits follow nearly every operation), nothing is written in
+* place before it is logged - the shard grows instead - and after a
+* crash the directory is whole
+*/
+START_TEST(journal_pinned_test) {
+    char path[32];
+    struct stat sb;
+    struct block_stats bs;
+    system("python gen-disk.py -q journal.in test.img");
+    block_cache_capacity = 32;
+    block_init("test.img");
+    fs_ops.init(NULL);
+    block_reset_stats();
+
+    ck_assert_int_eq(0, fs_ops.mkdir("/p", 0777));
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/p/f%d", i);
+        ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+    }
+    ck_assert_int_eq(0, block_flush(1));
+    block_get_stats(&bs);
+    ck_assert(bs.extra > 0);
+
+    fs_ops.init(NULL);
+    int n = 0;
+    ck_assert_int_eq(0, fs_ops.readdir("/p", &n, count_filler, 0, NULL));
+    ck_assert_int_eq(300, n);
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/p/f%d", i);
+        ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+    }
+    fs_ops.destroy(NULL);
+
+    block_cache_capacity = 2048;
+    block_init("test.img");
+}
+END_TEST
+
+/**
+* @brief fsync writes back one file's blocks and leaves the rest of the
+* cache dirty; -durability sync makes every change durable at once,
+* and "none" ignores fsync. The "crash" drops the cache unwritten.
+*/
+START_TEST(durability_test) {
+    struct stat sb;
+    struct block_stats bs;
+    char buf[8];
+    ck_assert_int_eq(0, fs_ops.create("/a", 0100666, NULL));
+    ck_assert_int_eq(0, fs_ops.create("/b", 0100666, NULL));
+    ck_assert_int_eq(0, block_flush(1));
+    ck_assert_int_eq(5, fs_ops.write("/a", "aaaaa", 5, 0, NULL));
+    ck_assert_int_eq(5, fs_ops.write("/b", "bbbbb", 5, 0, NULL));
+    block_reset_stats();
+    ck_assert_int_eq(0, fs_ops.fsync("/a", 0, NULL));
+    block_get_stats(&bs);
+    ck_assert_int_eq(1, bs.syncs);
+    ck_assert(bs.dirty > 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.getattr("/a", &sb));
+    ck_assert_int_eq(5, sb.st_size);
+    ck_assert_int_eq(5, fs_ops.read("/a", buf, 8, 0, NULL));
+    ck_assert(memcmp(buf, "aaaaa", 5) == 0);
+    ck_assert_int_eq(0, fs_ops.getattr("/b", &sb));
+    ck_assert_int_eq(0, sb.st_size);
+
+    ck_assert_int_eq(0, set_durability("sync"));
+    ck_assert_int_eq(0, fs_ops.create("/c", 0100666, NULL));
+    ck_assert_int_eq(3, fs_ops.write("/c", "ccc", 3, 0, NULL));
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.getattr("/c", &sb));
+    ck_assert_int_eq(3, sb.st_size);
+
+    ck_assert_int_eq(0, set_durability("none"));
+    block_reset_stats();
+    ck_assert_int_eq(3, fs_ops.write("/c", "ddd", 3, 0, NULL));
+    ck_assert_int_eq(0, fs_ops.fsync("/c", 0, NULL));
+    block_get_stats(&bs);
+    ck_assert_int_eq(0, bs.syncs);
+    ck_assert_int_eq(-1, set_durability("always"));
+    ck_assert_int_eq(0, set_durability("fsync"));
+}
+END_TEST
+
+/**
+* @brief tracing counts calls, errors and block I/O for each operation: a
+* cold getattr three levels down reads inode and directory blocks on
+* the way, a repeated one finds them cached
+*/
+START_TEST(trace_test) {
+    struct stat sb;
+    struct trace_stats st;
+    char line[256];
+    trace_install(NULL);
+    trace_reset();
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.getattr("/dir3/subdir/file.4k-", &sb));
+    ck_assert_int_eq(0, trace_get_stats("getattr", &st));
+    ck_assert_int_eq(1, st.calls);
+    ck_assert(st.dev_reads >= 4);
+    ck_assert_int_eq(0, fs_ops.getattr("/dir3/subdir/file.4k-", &sb));
+    ck_assert_int_eq(-ENOENT, fs_ops.getattr("/dir3/nothere", &sb));
+    ck_assert_int_eq(0, trace_get_stats("getattr", &st));
+    ck_assert_int_eq(3, st.calls);
+    ck_assert_int_eq(1, st.errors);
+    ck_assert(st.p50_ns <= st.p99_ns && st.p99_ns <= st.max_ns && st.max_ns > 0);
+    ck_assert_int_eq(-1, trace_get_stats("nosuchop", &st));
+
+    FILE *fp = tmpfile();
+    trace_dump(fp);
+    rewind(fp);
+    int found = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        found += strncmp(line, "getattr ", 8) == 0;
+    }
+    fclose(fp);
+    ck_assert_int_eq(1, found);
+}
+END_TEST
+
 void reset_testdata() {
     for (int i = 0; mkdir_table[i].childpath != NULL; i++) {
         mkdir_table[i].found = 0;
@@ -501,14 +1316,546 @@ void reset_testdata() {
 
 void initial_reset_disk() {
     system("python gen-disk.py -q disk1.in test.img");
+    fs_ops.init(NULL);
     reset_testdata();
 }
 
 void end_reset_disk() {
     system("python gen-disk.py -q disk1.in test.img");
+    fs_ops.init(NULL);
     reset_testdata();
 }
 
+#define REPLY_FILES 100
+
+struct reply_dir {
+    int n;
+    size_t size, ends[REPLY_FILES + 2];
+};
+
+int reply_filler(void *ptr, const char *name, const struct stat *st, off_t off) {
+    struct reply_dir *d = ptr;
+    d->size += (24 + strlen(name) + 7) & ~7;    /* as fuse_add_direntry */
+    d->ends[d->n++] = d->size;
+    return 0;
+}
+
+/**
+* @brief hw3ll's readdir replies: a directory too big for one reply is
+* handed out a reply at a time, each starting where the last one
+* stopped, and every entry comes back exactly once
+*/
+START_TEST(readdir_reply_test) {
+    char path[64];
+    static struct reply_dir d;
+    ck_assert_int_eq(0, fs_ops.mkdir("/many", 0777));
+    for (int i = 0; i < REPLY_FILES; i++) {
+        sprintf(path, "/many/file-number-%d", i);
+        ck_assert_int_eq(0, fs_ops.create(path, 0100666, NULL));
+    }
+    ck_assert_int_eq(0, fs_ops.readdir("/many", &d, reply_filler, 0, NULL));
+    ck_assert(d.n >= REPLY_FILES);
+
+    off_t off = 0;
+    int replies = 0, entries = 0;
+    size_t len;
+    while ((len = fs_readdir_reply_len(d.ends, d.n, off, 1024)) > 0) {
+        ck_assert(len <= 1024);
+        for (int i = 0; i < d.n; i++) {
+            entries += (d.ends[i] > off && d.ends[i] <= off + len);
+        }
+        ck_assert(entries == d.n || d.ends[entries - 1] == off + len);
+        off += len;
+        replies++;
+    }
+    ck_assert_int_eq(d.size, off);
+    ck_assert_int_eq(d.n, entries);
+    ck_assert(replies > 1);
+
+    /* only whole entries, and none if the first doesn't fit */
+    ck_assert_int_eq(0, fs_readdir_reply_len(d.ends, d.n, 0, d.ends[0] - 1));
+    ck_assert_int_eq(d.ends[1], fs_readdir_reply_len(d.ends, d.n, 0, d.ends[2] - 1));
+    ck_assert_int_eq(d.ends[2] - d.ends[0],
+                     fs_readdir_reply_len(d.ends, d.n, d.ends[0], d.ends[2] - d.ends[0]));
+}
+END_TEST
+
+/* worker for concurrent_test: create a file in its own directory and
+ * one in the shared directory, write them, rename the shared one (a
+ * rename stays in its directory), read back and unlink every other
+ * one. Checks can't fail
+ * in a thread, so it returns the number of calls that went wrong.
+ */
+#define CONC_THREADS 4
+#define CONC_FILES 40
+
+static void *conc_worker(void *arg)
+{
+    long t = (long)arg, errors = 0;
+    char path[64], path2[64], own[64], data[64], buf[64];
+    for (int i = 0; i < CONC_FILES; i++) {
+        sprintf(own, "/t%ld/f%d", t, i);
+        sprintf(path, "/shared/t%ld-f%d", t, i);
+        sprintf(path2, "/shared/t%ld-g%d", t, i);
+        int len = sprintf(data, "thread %ld file %d", t, i);
+        errors += fs_ops.create(own, 0100666, NULL) != 0;
+        errors += fs_ops.write(own, data, len, 0, NULL) != len;
+        errors += fs_ops.create(path, 0100666, NULL) != 0;
+        errors += fs_ops.write(path, data, len, 0, NULL) != len;
+        errors += fs_ops.rename(path, path2) != 0;
+        errors += fs_ops.read(path2, buf, sizeof(buf), 0, NULL) != len;
+        errors += memcmp(buf, data, len) != 0;
+        if (i % 2 == 0) {
+            errors += fs_ops.unlink(own) != 0;
+            errors += fs_ops.unlink(path2) != 0;
+        }
+    }
+    return (void *)errors;
+}
+
+/**
+* @brief several threads changing the tree at once, on a journaled image so
+* that txn_lock is taken along with ns_lock, the inode locks and
+* alloc_lock: every call succeeds, the survivors are all there after
+* a crash, and once they are gone no blocks or inodes leaked
+*/
+START_TEST(concurrent_test) {
+    char path[64], buf[64];
+    struct stat sb;
+    struct statvfs before, after;
+    pthread_t th[CONC_THREADS];
+    system("python gen-disk.py -q journal.in test.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.statfs("/", &before));
+    ck_assert_int_eq(0, fs_ops.mkdir("/shared", 0777));
+    for (long t = 0; t < CONC_THREADS; t++) {
+        sprintf(path, "/t%ld", t);
+        ck_assert_int_eq(0, fs_ops.mkdir(path, 0777));
+    }
+    for (long t = 0; t < CONC_THREADS; t++) {
+        ck_assert_int_eq(0, pthread_create(&th[t], NULL, conc_worker, (void *)t));
+    }
+    for (long t = 0; t < CONC_THREADS; t++) {
+        void *errors;
+        pthread_join(th[t], &errors);
+        ck_assert_int_eq(0, (long)errors);
+    }
+    ck_assert_int_eq(0, block_flush(1));
+
+    fs_ops.init(NULL);
+    int n = 0;
+    ck_assert_int_eq(0, fs_ops.readdir("/shared", &n, count_filler, 0, NULL));
+    ck_assert_int_eq(CONC_THREADS * CONC_FILES / 2, n);
+    for (long t = 0; t < CONC_THREADS; t++) {
+        n = 0;
+        sprintf(path, "/t%ld", t);
+        ck_assert_int_eq(0, fs_ops.readdir(path, &n, count_filler, 0, NULL));
+        ck_assert_int_eq(CONC_FILES / 2, n);
+        for (int i = 1; i < CONC_FILES; i += 2) {
+            int len = sprintf(buf, "thread %ld file %d", t, i);
+            sprintf(path, "/t%ld/f%d", t, i);
+            ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+            ck_assert_int_eq(len, sb.st_size);
+            ck_assert_int_eq(0, fs_ops.unlink(path));
+            sprintf(path, "/shared/t%ld-g%d", t, i);
+            ck_assert_int_eq(0, fs_ops.getattr(path, &sb));
+            ck_assert_int_eq(len, sb.st_size);
+            ck_assert_int_eq(0, fs_ops.unlink(path));
+        }
+        sprintf(path, "/t%ld", t);
+        ck_assert_int_eq(0, fs_ops.rmdir(path));
+    }
+    ck_assert_int_eq(0, fs_ops.rmdir("/shared"));
+    ck_assert_int_eq(0, fs_ops.statfs("/", &after));
+    ck_assert_int_eq(before.f_bfree, after.f_bfree);
+    ck_assert_int_eq(before.f_ffree, after.f_ffree);
+    fs_ops.destroy(NULL);
+}
+END_TEST
+
+/**
+* @brief a freed block isn't handed out again - not even when asked for by
+* name - until a durable flush has written out whatever stopped using
+* it; after that it is
+*/
+START_TEST(pending_free_test) {
+    int got;
+    int b = alloc_extent(0, 1, &got);
+    ck_assert(b > 0 && got == 1);
+    flush_bitmap();
+    ck_assert_int_eq(0, block_flush(1));
+
+    mark_block_free(b);
+    int c = alloc_extent(b, 1, &got);
+    ck_assert(c > 0 && c != b);
+    unmark_block_used(c);
+    flush_bitmap();
+    c = alloc_extent(b, 1, &got);
+    ck_assert(c > 0 && c != b);
+    unmark_block_used(c);
+    flush_bitmap();
+
+    ck_assert_int_eq(0, block_flush(1));
+    ck_assert_int_eq(b, alloc_extent(b, 1, &got));
+    unmark_block_used(b);
+    flush_bitmap();
+}
+END_TEST
+
+/**
+* @brief block_write only dirties the cache: nothing reaches the image until
+* a flush, which writes back exactly the dirty blocks, and repeated
+* reads of the same metadata are hits. (The timed flush is turned off
+* so it can't go first.)
+*/
+START_TEST(write_back_test) {
+    char data[3 * FS_BLOCK_SIZE], buf[3 * FS_BLOCK_SIZE];
+    struct stat sb;
+    struct block_stats bs;
+    memset(data, 'w', sizeof(data));
+    block_flush_interval = 0;
+    ck_assert_int_eq(0, block_flush(1));
+    block_reset_stats();
+
+    ck_assert_int_eq(0, fs_ops.create("/wb", 0100666, NULL));
+    ck_assert_int_eq(sizeof(data), fs_ops.write("/wb", data, sizeof(data), 0, NULL));
+    ck_assert_int_eq(sizeof(buf), fs_ops.read("/wb", buf, sizeof(buf), 0, NULL));
+    ck_assert(memcmp(buf, data, sizeof(data)) == 0);
+    block_get_stats(&bs);
+    ck_assert(bs.writes > 0);
+    ck_assert_int_eq(0, bs.dev_writes);
+    ck_assert_int_eq(0, bs.writebacks);
+    ck_assert(bs.dirty >= 3);
+
+    ck_assert_int_eq(0, fs_ops.getattr("/dir3/subdir/file.4k-", &sb));
+    block_get_stats(&bs);
+    unsigned long hits = bs.hits, misses = bs.misses;
+    for (int i = 0; i < 10; i++) {
+        ck_assert_int_eq(0, fs_ops.getattr("/dir3/subdir/file.4k-", &sb));
+    }
+    block_get_stats(&bs);
+    ck_assert_int_eq(misses, bs.misses);
+    ck_assert(bs.hits >= hits + 10);
+    ck_assert_int_eq(0, bs.dev_writes);
+
+    int dirty = bs.dirty;
+    ck_assert_int_eq(0, block_flush(1));
+    block_get_stats(&bs);
+    ck_assert_int_eq(dirty, bs.writebacks);
+    ck_assert_int_eq(0, bs.dirty);
+    ck_assert(bs.dev_writes > 0 && bs.dev_writes <= dirty);
+    ck_assert_int_eq(1, bs.syncs);
+
+    /* written back, so it survives the cache being dropped */
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.getattr("/wb", &sb));
+    ck_assert_int_eq(sizeof(data), sb.st_size);
+    ck_assert_int_eq(sizeof(buf), fs_ops.read("/wb", buf, sizeof(buf), 0, NULL));
+    ck_assert(memcmp(buf, data, sizeof(data)) == 0);
+    block_flush_interval = 5;
+}
+END_TEST
+
+/**
+* @brief blocks aren't zeroed when they are freed or allocated - a freed
+* block keeps its contents on disk - but a file never shows stale
+* data: with the disk full, a new file gets the freed blocks back, and
+* the parts of them it never wrote are zero, before and after a
+* remount. (A write can't start past EOF, so there are no holes: the
+* unwritten parts are the tails of partly written blocks.)
+*/
+START_TEST(no_zero_test) {
+    char xs[FS_BLOCK_SIZE], buf[3 * FS_BLOCK_SIZE];
+    struct stat sb;
+    struct fs_inode in;
+    struct block_stats bs;
+    memset(xs, 'x', sizeof(xs));
+
+    ck_assert_int_eq(0, fs_ops.create("/z", 0100666, NULL));
+    ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/z", xs, FS_BLOCK_SIZE, 0, NULL));
+    ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/z", xs, FS_BLOCK_SIZE,
+                                                 FS_BLOCK_SIZE, NULL));
+    int inum = fs_lookup_at(2, "z", &sb);
+    ck_assert(inum > 0);
+    ck_assert_int_eq(0, read_inode(inum, &in));
+    int old[3] = {inum, in.ptrs[0], in.ptrs[1]};
+    ck_assert_int_eq(0, fs_ops.create("/fill", 0100666, NULL));
+    for (off_t off = 0; fs_ops.write("/fill", xs, FS_BLOCK_SIZE, off, NULL) ==
+             FS_BLOCK_SIZE; off += FS_BLOCK_SIZE)
+        ;
+    ck_assert_int_eq(0, block_flush(1));
+    ck_assert_int_eq(0, fs_ops.unlink("/z"));
+    ck_assert_int_eq(0, block_flush(1));
+    ck_assert_int_eq(0, block_read(buf, old[1], 1));
+    ck_assert(memcmp(buf, xs, FS_BLOCK_SIZE) == 0);
+
+    int got;
+    block_reset_stats();
+    int b = alloc_extent(0, 4, &got);
+    ck_assert(b > 0);
+    block_get_stats(&bs);
+    ck_assert_int_eq(0, bs.writes);
+    for (int i = 0; i < got; i++) {
+        unmark_block_used(b + i);
+    }
+    flush_bitmap();
+
+    /* block 0 written in two pieces, block 1 only its first 6 bytes */
+    ck_assert_int_eq(0, fs_ops.create("/h", 0100666, NULL));
+    ck_assert_int_eq(3, fs_ops.write("/h", "abc", 3, 0, NULL));
+    ck_assert_int_eq(3, fs_ops.write("/h", "def", 3, 3, NULL));
+    ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/h", xs, FS_BLOCK_SIZE, 6, NULL));
+    inum = fs_lookup_at(2, "h", &sb);
+    ck_assert(inum > 0);
+    ck_assert_int_eq(0, read_inode(inum, &in));
+    ck_assert(in.ptrs[0] == old[0] || in.ptrs[0] == old[1] || in.ptrs[0] == old[2]);
+    ck_assert(in.ptrs[1] == old[1] || in.ptrs[1] == old[2]);
+    for (int pass = 0; pass < 2; pass++) {
+        memset(buf, '?', sizeof(buf));
+        ck_assert_int_eq(FS_BLOCK_SIZE + 6,
+                         fs_ops.read("/h", buf, sizeof(buf), 0, NULL));
+        ck_assert(memcmp(buf, "abcdef", 6) == 0);
+        ck_assert(memcmp(buf + 6, xs, FS_BLOCK_SIZE) == 0);
+        ck_assert_int_eq(0, fs_ops.read("/h", buf, sizeof(buf), FS_BLOCK_SIZE + 6, NULL));
+        ck_assert_int_eq(0, block_read(buf, in.ptrs[1], 1));
+        ck_assert(memcmp(buf, xs, 6) == 0);
+        for (int i = 6; i < FS_BLOCK_SIZE; i++) {
+            ck_assert_int_eq(0, buf[i]);
+        }
+        ck_assert_int_eq(0, block_flush(1));
+        fs_ops.init(NULL);
+    }
+}
+END_TEST
+
+/**
+* @brief a file can't outgrow its 32-bit size: a write across 2^31 - 1 bytes
+* is cut short there, the next one fails with EFBIG, and the file
+* still reads back whole
+*/
+START_TEST(max_size_test) {
+    int chunk = 1024 * 1024;
+    char *buf = malloc(chunk), *rbuf = malloc(chunk);
+    struct stat sb;
+    system("python gen-disk.py -q huge.in test.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.create("/max", 0100666, NULL));
+    off_t off = 0;
+    for (int k = 0; k < 2048; k++, off += chunk) {
+        memset(buf, 'a' + k % 26, chunk);
+        int n = (k < 2047) ? chunk : chunk - 1;
+        ck_assert_int_eq(n, fs_ops.write("/max", buf, chunk, off, NULL));
+    }
+    ck_assert_int_eq(-EFBIG, fs_ops.write("/max", buf, chunk, 0x7fffffff, NULL));
+    ck_assert_int_eq(0, fs_ops.getattr("/max", &sb));
+    ck_assert_int_eq(0x7fffffff, sb.st_size);
+
+    ck_assert_int_eq(chunk - 1, fs_ops.read("/max", rbuf, chunk, off - chunk, NULL));
+    ck_assert(memcmp(rbuf, buf, chunk - 1) == 0);
+    ck_assert_int_eq(chunk, fs_ops.read("/max", rbuf, chunk, 0, NULL));
+    ck_assert_int_eq('a', rbuf[0]);
+    ck_assert_int_eq(3, fs_ops.write("/max", "xyz", 3, 0, NULL));
+    ck_assert_int_eq(0, fs_ops.unlink("/max"));
+    fs_ops.destroy(NULL);
+    free(buf);
+    free(rbuf);
+}
+END_TEST
+
+/**
+* @brief an image from before the indirect pointers (FS_FEAT_INDIRECT clear)
+* keeps all N_PTRS inode pointers direct: a file takes no pointer
+* blocks and stops at N_PTRS blocks, and reads back after a remount
+*/
+START_TEST(all_direct_test) {
+    char buf[FS_BLOCK_SIZE], rbuf[FS_BLOCK_SIZE];
+    struct fs_super super;
+    struct statvfs before, st;
+    system("python gen-disk.py -q plain.in test.img");
+    FILE *fp = fopen("test.img", "r+");
+    ck_assert(fread(&super, sizeof(super), 1, fp) == 1);
+    ck_assert(super.features & FS_FEAT_INDIRECT);
+    super.features &= ~FS_FEAT_INDIRECT;
+    rewind(fp);
+    ck_assert(fwrite(&super, sizeof(super), 1, fp) == 1);
+    fclose(fp);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.statfs("/", &before));
+
+    ck_assert_int_eq(0, fs_ops.create("/old", 0100666, NULL));
+    memset(buf, 0, sizeof(buf));
+    for (int i = 0; i < N_PTRS; i++) {
+        sprintf(buf, "block %d", i);
+        ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.write("/old", buf, FS_BLOCK_SIZE,
+                                                     (off_t)i * FS_BLOCK_SIZE, NULL));
+    }
+    ck_assert_int_eq(-EFBIG, fs_ops.write("/old", buf, FS_BLOCK_SIZE,
+                                          (off_t)N_PTRS * FS_BLOCK_SIZE, NULL));
+    ck_assert_int_eq(0, fs_ops.statfs("/", &st));
+    ck_assert_int_eq(before.f_bfree - N_PTRS - 1, st.f_bfree);
+
+    ck_assert_int_eq(0, block_flush(1));
+    fs_ops.init(NULL);
+    for (int i = N_DIRECT - 1; i < N_PTRS; i++) {
+        sprintf(buf, "block %d", i);
+        ck_assert_int_eq(FS_BLOCK_SIZE, fs_ops.read("/old", rbuf, FS_BLOCK_SIZE,
+                                                    (off_t)i * FS_BLOCK_SIZE, NULL));
+        ck_assert_int_eq(0, strcmp(buf, rbuf));
+    }
+    ck_assert_int_eq(0, fs_ops.unlink("/old"));
+    ck_assert_int_eq(0, fs_ops.statfs("/", &st));
+    ck_assert_int_eq(before.f_bfree, st.f_bfree);
+    fs_ops.destroy(NULL);
+}
+END_TEST
+
+/**
+* @brief testing a bad superblock fails fs_mount instead of exiting,
+* and a good image mounts afterwards
+*/
+START_TEST(mount_error_test) {
+    struct fs_super super;
+    struct stat sb;
+    system("python gen-disk.py -q big.in test.img");
+    FILE *fp = fopen("test.img", "r+");
+    ck_assert(fread(&super, sizeof(super), 1, fp) == 1);
+    super.bitmap_blocks = 1;
+    rewind(fp);
+    ck_assert(fwrite(&super, sizeof(super), 1, fp) == 1);
+    fclose(fp);
+    ck_assert_int_eq(-EINVAL, fs_mount());
+
+    system("python gen-disk.py -q disk1.in test.img");
+    ck_assert_int_eq(0, fs_mount());
+    ck_assert_int_eq(0, fs_ops.getattr("/file.1k", &sb));
+    ck_assert_int_eq(1000, sb.st_size);
+}
+END_TEST
+
+/**
+* @brief testing a journal too small for one operation is refused, and a
+* big write under the journal is cut short to fit in a commit
+*/
+START_TEST(journal_size_test) {
+    struct fs_super super;
+    struct stat sb;
+    FILE *fp = fopen("tiny.in", "w");
+    fprintf(fp, "size 8192\njournal 32\n$t 0\n$d 0o40777\ndir 2 / $t $t $d $t $t 4096 3\n");
+    fclose(fp);
+    ck_assert(system("python gen-disk.py -q tiny.in tiny.img") != 0);
+    unlink("tiny.in");
+    unlink("tiny.img");
+
+    system("python gen-disk.py -q journal.in test.img");
+    fp = fopen("test.img", "r+");
+    ck_assert(fread(&super, sizeof(super), 1, fp) == 1);
+    super.journal_blocks = 32;
+    rewind(fp);
+    ck_assert(fwrite(&super, sizeof(super), 1, fp) == 1);
+    fclose(fp);
+    ck_assert_int_eq(-EINVAL, fs_mount());
+
+    system("python gen-disk.py -q journal.in test.img");
+    ck_assert_int_eq(0, fs_mount());
+    int len = 20 * 1024 * 1024, cut = 4096 * 4 * 1024;
+    char *buf = calloc(len, 1);
+    ck_assert_int_eq(0, fs_ops.create("/big", 0100666, NULL));
+    ck_assert_int_eq(cut, fs_ops.write("/big", buf, len, 0, NULL));
+    ck_assert_int_eq(len - cut, fs_ops.write("/big", buf + cut, len - cut, cut, NULL));
+    ck_assert_int_eq(0, block_flush(1));
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.getattr("/big", &sb));
+    ck_assert_int_eq(len, sb.st_size);
+    ck_assert_int_eq(0, fs_ops.unlink("/big"));
+    free(buf);
+    fs_ops.destroy(NULL);
+}
+END_TEST
+
+/**
+* @brief testing a create or mkdir in a full directory leaves no inode
+* behind in the inode table
+*/
+START_TEST(full_dir_inode_test) {
+    struct fs_super super;
+    char path[32];
+    FILE *fp = fopen("flat.in", "w");
+    fprintf(fp, "size 2048\nfeatures small_inodes\ninodes 1024\n"
+            "$t 0\n$d 0o40777\ndir 2 / $t $t $d $t $t 4096 3\n");
+    fclose(fp);
+    system("python gen-disk.py -q flat.in test.img");
+    unlink("flat.in");
+    fs_ops.init(NULL);
+
+    int n = 0, rv;
+    while (1) {
+        sprintf(path, "/f%d", n);
+        if ((rv = fs_ops.create(path, 0100666, NULL)) < 0) {
+            break;
+        }
+        n++;
+    }
+    ck_assert_int_eq(-ENOSPC, rv);
+    ck_assert_int_eq(-ENOSPC, fs_ops.mkdir("/d", 0777));
+    ck_assert_int_eq(0, block_flush(1));
+
+    fp = fopen("test.img", "r");
+    ck_assert(fread(&super, sizeof(super), 1, fp) == 1);
+    struct fs_small_inode *tbl = malloc(super.ninodes * sizeof(*tbl));
+    fseek(fp, (long)super.inode_table * FS_BLOCK_SIZE, SEEK_SET);
+    ck_assert(fread(tbl, sizeof(*tbl), super.ninodes, fp) == super.ninodes);
+    fclose(fp);
+    int used = 0;
+    for (int i = 0; i < (int)super.ninodes; i++) {
+        used += (tbl[i].mode != 0);
+    }
+    ck_assert_int_eq(n + 1, used);
+    free(tbl);
+    fs_ops.destroy(NULL);
+}
+END_TEST
+
+/**
+* @brief testing an entry pointing at an unreadable inode gives EIO from
+* getattr and lookups, and the EIO isn't cached
+*/
+START_TEST(bad_inode_test) {
+    struct fs_super super;
+    struct fs_small_inode root;
+    struct fs_dirent ents[FS_BLOCK_SIZE / sizeof(struct fs_dirent)];
+    struct stat sb;
+    system("python gen-disk.py -q big.in test.img");
+    fs_ops.init(NULL);
+    ck_assert_int_eq(0, fs_ops.mkdir("/d", 0777));
+    ck_assert_int_eq(0, fs_ops.create("/d/x", 0100666, NULL));
+    fs_ops.destroy(NULL);
+
+    /* point "d" past the end of the inode table */
+    FILE *fp = fopen("test.img", "r+");
+    ck_assert(fread(&super, sizeof(super), 1, fp) == 1);
+    fseek(fp, (long)super.inode_table * FS_BLOCK_SIZE + 2 * sizeof(root), SEEK_SET);
+    ck_assert(fread(&root, sizeof(root), 1, fp) == 1);
+    fseek(fp, (long)root.ptrs[0] * FS_BLOCK_SIZE, SEEK_SET);
+    ck_assert(fread(ents, sizeof(ents), 1, fp) == 1);
+    int i, n = sizeof(ents) / sizeof(ents[0]);
+    for (i = 0; i < n && strcmp(ents[i].name, "d") != 0; i++)
+        ;
+    ck_assert(i < n);
+    ents[i].inode = super.ninodes + 1;
+    fseek(fp, (long)root.ptrs[0] * FS_BLOCK_SIZE, SEEK_SET);
+    ck_assert(fwrite(ents, sizeof(ents), 1, fp) == 1);
+    fclose(fp);
+
+    fs_ops.init(NULL);
+    ck_assert_int_eq(-EIO, fs_ops.getattr("/d", &sb));
+    for (int k = 0; k < 2; k++) {
+        ck_assert_int_eq(-EIO, fs_ops.getattr("/d/x", &sb));
+        ck_assert_int_eq(-EIO, fs_ops.create("/d/y", 0100666, NULL));
+    }
+    ck_assert_int_eq(0, fs_ops.getattr("/", &sb));
+}
+END_TEST
+
 void test_setup(Suite *s, const char *str, const TTest *f) {
     TCase *tc = tcase_create(str);
     tcase_add_test(tc, f);
@@ -539,6 +1886,35 @@ int main(int argc, char **argv) {
     test_setup(s, "test11 - fswrite test", fswrite_test);
     test_setup(s, "test12 - write smallfile test", write_smallfile_test);
     test_setup(s, "test13 - fs_truncate test", fs_truncate_test);
+    test_setup(s, "test14 - lookup after namespace change test", lookup_after_change_test);
+    test_setup(s, "test15 - fswrite extent test", fswrite_extent_test);
+    test_setup(s, "test16 - fill disk test", fill_disk_test);
+    test_setup(s, "test17 - fswrite indirect test", fswrite_indirect_test);
+    test_setup(s, "test18 - big directory test", big_dir_test);
+    test_setup(s, "test19 - small inode test", small_inode_test);
+    test_setup(s, "test20 - big disk test", big_disk_test);
+    test_setup(s, "test21 - mmap test", mmap_test);
+    test_setup(s, "test22 - io_uring test", uring_test);
+    test_setup(s, "test23 - readahead test", readahead_test);
+    test_setup(s, "test24 - open file handle test", open_handle_test);
+    test_setup(s, "test25 - inode number interface test", inum_api_test);
+    test_setup(s, "test26 - connection options test", conn_setup_test);
+    test_setup(s, "test27 - readdir inode prefetch test", readdir_prefetch_test);
+    test_setup(s, "test28 - journal test", journal_test);
+    test_setup(s, "test29 - durability modes test", durability_test);
+    test_setup(s, "test30 - operation trace test", trace_test);
+    test_setup(s, "test31 - low-level readdir reply test", readdir_reply_test);
+    test_setup(s, "test32 - journal with pinned cache test", journal_pinned_test);
+    test_setup(s, "test33 - concurrent namespace changes test", concurrent_test);
+    test_setup(s, "test34 - pending free test", pending_free_test);
+    test_setup(s, "test35 - write-back cache test", write_back_test);
+    test_setup(s, "test36 - no block zeroing test", no_zero_test);
+    test_setup(s, "test37 - maximum file size test", max_size_test);
+    test_setup(s, "test38 - all-direct inode test", all_direct_test);
+    test_setup(s, "test39 - mount error test", mount_error_test);
+    test_setup(s, "test40 - journal size test", journal_size_test);
+    test_setup(s, "test41 - full directory inode test", full_dir_inode_test);
+    test_setup(s, "test42 - unreadable inode test", bad_inode_test);
     srunner_set_fork_status(sr, CK_NOFORK);
 
     srunner_run_all(sr, CK_VERBOSE);